@@ -1,21 +1,361 @@
 //Joseph Clauss
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define CACHE_LINE_SIZE 64
+#define DEFAULT_CAPACITY 1024
+#define DEFAULT_BATCH 1
+#define MAX_BATCH 4096
+#define MAX_THREADS 256
+#define SPINS_BEFORE_SLEEP 128 // Spin iterations before a hybrid waiter sleeps on the futex
+#define LATENCY_SAMPLE_EVERY 64 // Record handoff latency for one item in every 64
+#define END_OF_STREAM -1        // Sentinel telling a throughput consumer to stop
+
+// Bounded single-producer/single-consumer ring buffer.
+// head is only written by the consumer and tail only by the producer, so each
+// index lives on its own cache line together with the owner's cached copy of
+// the other side's index.
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head; // Next slot to read
+    size_t cached_tail;                            // Consumer's last view of tail
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail; // Next slot to write
+    size_t cached_head;                            // Producer's last view of head
+    _Alignas(CACHE_LINE_SIZE) size_t capacity;    // Always a power of two
+    size_t mask;
+    int *slots;
+} RingBuffer;
+
+// Bounded multi-producer/multi-consumer queue (Vyukov design).
+// Each cell carries a sequence number that tells producers and consumers
+// whether the cell is ready for them at their current position.
+typedef struct {
+    atomic_size_t sequence;
+    int data;
+} QueueCell;
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t enqueue_pos;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t dequeue_pos;
+    _Alignas(CACHE_LINE_SIZE) size_t capacity; // Always a power of two, at least 2
+    size_t mask;
+    QueueCell *cells;
+} WorkQueue;
+
+// How a thread waits when the queue is full or empty
+typedef enum {
+    WAIT_SPIN,    // Busy-wait with a pause instruction, lowest latency, burns a core
+    WAIT_HYBRID,  // Spin briefly, then sleep on a futex
+    WAIT_CONDVAR  // Sleep on a pthread condition variable straight away
+} WaitStrategy;
+
+// A place threads sleep until the other side makes progress.
+// seq is bumped by a notifier only when somebody is registered in waiters,
+// so the uncontended fast path never touches the futex or the mutex.
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_uint seq;
+    atomic_int waiters;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} WaitPoint;
 
 // Buffer and associated variables
-int buffer;
-int is_buffer_full = 0; // Buffer status flag
+RingBuffer buffer;
+WorkQueue work_queue;
+bool use_mpmc = false; // Use work_queue instead of the single-producer buffer
+WaitPoint items_available;
+WaitPoint space_available;
+WaitStrategy wait_strategy = WAIT_HYBRID;
+bool sleep_enabled = true; // Throttle producer/consumer with sleep(1)
+size_t batch_size = DEFAULT_BATCH;
+int num_producers = 1;
+int num_consumers = 1;
+
+// Throughput mode state
+long throughput_items = 0; // 0 means run the interactive demo forever
+uint64_t *sent_ns;         // Per-sample send timestamp
+uint64_t *latency_ns;      // Per-sample handoff latency
 
 // Function prototypes
 void *producer(void *param);
 void *consumer(void *param);
 
+// Return a monotonic timestamp in nanoseconds
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static void futex_wait(atomic_uint *addr, unsigned expected) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void wait_point_init(WaitPoint *wp) {
+    atomic_init(&wp->seq, 0);
+    atomic_init(&wp->waiters, 0);
+    pthread_mutex_init(&wp->mutex, NULL);
+    pthread_cond_init(&wp->cond, NULL);
+}
+
+void wait_point_destroy(WaitPoint *wp) {
+    pthread_mutex_destroy(&wp->mutex);
+    pthread_cond_destroy(&wp->cond);
+}
+
+// Register as a waiter. The caller must retry its operation once more after
+// this and then call either wait_sleep() or wait_cancel().
+unsigned wait_prepare(WaitPoint *wp) {
+    atomic_fetch_add(&wp->waiters, 1);
+    return atomic_load(&wp->seq);
+}
+
+void wait_cancel(WaitPoint *wp) {
+    atomic_fetch_sub(&wp->waiters, 1);
+}
+
+// Sleep until a notifier has bumped seq past the value from wait_prepare()
+void wait_sleep(WaitPoint *wp, unsigned seq) {
+    if (wait_strategy == WAIT_CONDVAR) {
+        pthread_mutex_lock(&wp->mutex);
+        while (atomic_load(&wp->seq) == seq) {
+            pthread_cond_wait(&wp->cond, &wp->mutex);
+        }
+        pthread_mutex_unlock(&wp->mutex);
+    } else {
+        futex_wait(&wp->seq, seq);
+    }
+    atomic_fetch_sub(&wp->waiters, 1);
+}
+
+// Wake up to count threads sleeping on wp after the caller has published progress
+void wait_notify(WaitPoint *wp, size_t count) {
+    if (wait_strategy == WAIT_SPIN) {
+        return;
+    }
+    // Pairs with the waiter's fetch_add in wait_prepare(): either the waiter's
+    // retry sees our update or we see the waiter.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&wp->waiters, memory_order_relaxed) == 0) {
+        return;
+    }
+    if (wait_strategy == WAIT_CONDVAR) {
+        pthread_mutex_lock(&wp->mutex);
+        atomic_fetch_add(&wp->seq, 1);
+        if (count == 1) {
+            pthread_cond_signal(&wp->cond);
+        } else {
+            pthread_cond_broadcast(&wp->cond);
+        }
+        pthread_mutex_unlock(&wp->mutex);
+    } else {
+        atomic_fetch_add(&wp->seq, 1);
+        futex_wake(&wp->seq, count > MAX_THREADS ? MAX_THREADS : (int)count);
+    }
+}
+
+// Decide whether a failed attempt should go to sleep or simply retry
+static bool should_sleep(unsigned *spins) {
+    switch (wait_strategy) {
+    case WAIT_SPIN:
+        cpu_relax();
+        return false;
+    case WAIT_HYBRID:
+        if (++(*spins) < SPINS_BEFORE_SLEEP) {
+            cpu_relax();
+            return false;
+        }
+        return true;
+    default:
+        return true;
+    }
+}
+
+// Initialize the ring buffer with a power-of-two capacity
+int ring_init(RingBuffer *rb, size_t capacity) {
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+        fprintf(stderr, "Capacity must be a power of two: %zu\n", capacity);
+        return -1;
+    }
+    rb->slots = malloc(capacity * sizeof(int));
+    if (rb->slots == NULL) {
+        perror("Unable to allocate ring buffer");
+        return -1;
+    }
+    atomic_init(&rb->head, 0);
+    atomic_init(&rb->tail, 0);
+    rb->cached_head = 0;
+    rb->cached_tail = 0;
+    rb->capacity = capacity;
+    rb->mask = capacity - 1;
+    return 0;
+}
+
+void ring_destroy(RingBuffer *rb) {
+    free(rb->slots);
+    rb->slots = NULL;
+}
+
+// Put up to n items without blocking, returns the number actually stored
+size_t ring_try_put_n(RingBuffer *rb, const int *items, size_t n) {
+    size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+    size_t free_slots = rb->capacity - (tail - rb->cached_head);
+    if (free_slots < n) {
+        rb->cached_head = atomic_load_explicit(&rb->head, memory_order_acquire);
+        free_slots = rb->capacity - (tail - rb->cached_head);
+        if (free_slots == 0) {
+            return 0;
+        }
+        if (n > free_slots) {
+            n = free_slots;
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        rb->slots[(tail + i) & rb->mask] = items[i];
+    }
+    atomic_store_explicit(&rb->tail, tail + n, memory_order_release);
+    return n;
+}
+
+// Get up to max items without blocking, returns the number actually read
+size_t ring_try_get_n(RingBuffer *rb, int *items, size_t max) {
+    size_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+    size_t ready = rb->cached_tail - head;
+    if (ready < max) {
+        rb->cached_tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+        ready = rb->cached_tail - head;
+        if (ready == 0) {
+            return 0;
+        }
+    }
+    size_t n = ready < max ? ready : max;
+    for (size_t i = 0; i < n; i++) {
+        items[i] = rb->slots[(head + i) & rb->mask];
+    }
+    atomic_store_explicit(&rb->head, head + n, memory_order_release);
+    return n;
+}
+
+// Initialize the work queue with a power-of-two capacity of at least 2
+int queue_init(WorkQueue *q, size_t capacity) {
+    if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+        fprintf(stderr, "Queue capacity must be a power of two and at least 2: %zu\n", capacity);
+        return -1;
+    }
+    q->cells = malloc(capacity * sizeof(QueueCell));
+    if (q->cells == NULL) {
+        perror("Unable to allocate work queue");
+        return -1;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&q->cells[i].sequence, i);
+    }
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+    q->capacity = capacity;
+    q->mask = capacity - 1;
+    return 0;
+}
+
+void queue_destroy(WorkQueue *q) {
+    free(q->cells);
+    q->cells = NULL;
+}
+
+// Try to enqueue one item, returns false if the queue is full
+bool queue_try_put(WorkQueue *q, int item) {
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        QueueCell *cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->data = item;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false; // Cell still holds an item from the previous lap
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// Try to dequeue one item, returns false if the queue is empty
+bool queue_try_get(WorkQueue *q, int *item) {
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        QueueCell *cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *item = cell->data;
+                atomic_store_explicit(&cell->sequence, pos + q->mask + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false; // Cell has not been filled yet
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// Put up to n items into whichever queue is in use without blocking
+size_t try_put_n(const int *items, size_t n) {
+    if (!use_mpmc) {
+        return ring_try_put_n(&buffer, items, n);
+    }
+    size_t done = 0;
+    while (done < n && queue_try_put(&work_queue, items[done])) {
+        done++;
+    }
+    return done;
+}
+
+// Get up to max items from whichever queue is in use without blocking.
+// Stops after an END_OF_STREAM item so each consumer receives at most one.
+size_t try_get_n(int *items, size_t max) {
+    if (!use_mpmc) {
+        return ring_try_get_n(&buffer, items, max);
+    }
+    size_t done = 0;
+    while (done < max && queue_try_get(&work_queue, &items[done])) {
+        if (items[done++] == END_OF_STREAM) {
+            break;
+        }
+    }
+    return done;
+}
+
 // Produce function
 int produce() {
-    static int product = 0;
-    return product++;
+    static atomic_int product = 0;
+    return atomic_fetch_add(&product, 1);
 }
 
 // Consume function
@@ -23,55 +363,299 @@ void consume(int i) {
     printf("Consumed: %d\n", i);
 }
 
+// Put n items into the buffer, waiting while it is full
+void put_n(const int *items, size_t n) {
+    unsigned spins = 0;
+    while (n > 0) {
+        size_t done = try_put_n(items, n);
+        if (done == 0) {
+            if (!should_sleep(&spins)) {
+                continue;
+            }
+            unsigned seq = wait_prepare(&space_available);
+            done = try_put_n(items, n);
+            if (done == 0) {
+                wait_sleep(&space_available, seq);
+                continue;
+            }
+            wait_cancel(&space_available);
+        }
+        wait_notify(&items_available, done);
+        spins = 0;
+        items += done;
+        n -= done;
+    }
+}
+
+// Get between 1 and max items from the buffer, waiting while it is empty
+size_t get_n(int *items, size_t max) {
+    unsigned spins = 0;
+    for (;;) {
+        size_t n = try_get_n(items, max);
+        if (n == 0) {
+            if (!should_sleep(&spins)) {
+                continue;
+            }
+            unsigned seq = wait_prepare(&items_available);
+            n = try_get_n(items, max);
+            if (n == 0) {
+                wait_sleep(&items_available, seq);
+                continue;
+            }
+            wait_cancel(&items_available);
+        }
+        wait_notify(&space_available, n);
+        return n;
+    }
+}
+
 // Put function (produces a product and puts it in the buffer)
 void put(int i) {
-    while (is_buffer_full) {
-        // Busy wait if buffer is full
-    }
-    buffer = i;
-    is_buffer_full = 1;
+    put_n(&i, 1);
 }
 
 // Get function (gets a product from the buffer and consumes it)
 int get() {
-    while (!is_buffer_full) {
-        // Busy wait if buffer is empty
-    }
-    int temp = buffer;
-    is_buffer_full = 0;
-    return temp;
+    int item;
+    get_n(&item, 1);
+    return item;
 }
 
 // Producer thread function
 void *producer(void *param) {
+    int items[MAX_BATCH];
     while (1) {
-        int item = produce();
-        put(item);
-        sleep(1); // Sleep to simulate time taken to produce an item
+        for (size_t i = 0; i < batch_size; i++) {
+            items[i] = produce();
+        }
+        put_n(items, batch_size);
+        if (sleep_enabled) {
+            sleep(1); // Sleep to simulate time taken to produce an item
+        }
     }
 }
 
 // Consumer thread function
 void *consumer(void *param) {
+    int items[MAX_BATCH];
     while (1) {
-        int item = get();
-        consume(item);
-        sleep(1); // Sleep to simulate time taken to consume an item
+        size_t n = get_n(items, batch_size);
+        for (size_t i = 0; i < n; i++) {
+            consume(items[i]);
+        }
+        if (sleep_enabled) {
+            sleep(1); // Sleep to simulate time taken to consume an item
+        }
     }
 }
 
-int main() {
-    pthread_t producer_thread, consumer_thread;
+// Throughput producer: pushes its share of throughput_items as fast as possible
+void *throughput_producer(void *param) {
+    long index = (long)(intptr_t)param;
+    long share = throughput_items / num_producers;
+    long next = index * share;
+    long end = index == num_producers - 1 ? throughput_items : next + share;
+    int items[MAX_BATCH];
+    while (next < end) {
+        size_t n = batch_size;
+        if ((long)n > end - next) {
+            n = end - next;
+        }
+        for (size_t i = 0; i < n; i++) {
+            items[i] = (int)(next + i);
+            if ((next + i) % LATENCY_SAMPLE_EVERY == 0) {
+                sent_ns[(next + i) / LATENCY_SAMPLE_EVERY] = now_ns();
+            }
+        }
+        put_n(items, n);
+        next += n;
+    }
+    return NULL;
+}
 
-    // Create the producer thread
-    pthread_create(&producer_thread, NULL, producer, NULL);
+// Throughput consumer: drains the buffer until it sees END_OF_STREAM and
+// records sampled handoff latency
+void *throughput_consumer(void *param) {
+    int items[MAX_BATCH];
+    while (1) {
+        size_t n = get_n(items, batch_size);
+        for (size_t i = 0; i < n; i++) {
+            if (items[i] == END_OF_STREAM) {
+                return NULL;
+            }
+            if (items[i] % LATENCY_SAMPLE_EVERY == 0) {
+                size_t sample = items[i] / LATENCY_SAMPLE_EVERY;
+                latency_ns[sample] = now_ns() - sent_ns[sample];
+            }
+        }
+    }
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
 
-    // Create the consumer thread
-    pthread_create(&consumer_thread, NULL, consumer, NULL);
+static const char *wait_strategy_name(WaitStrategy strategy) {
+    switch (strategy) {
+    case WAIT_SPIN:
+        return "spin";
+    case WAIT_HYBRID:
+        return "hybrid";
+    default:
+        return "condvar";
+    }
+}
+
+// Run a fixed number of items through the buffer and report throughput and latency
+int run_throughput() {
+    size_t samples = (throughput_items + LATENCY_SAMPLE_EVERY - 1) / LATENCY_SAMPLE_EVERY;
+    sent_ns = calloc(samples, sizeof(uint64_t));
+    latency_ns = calloc(samples, sizeof(uint64_t));
+    if (sent_ns == NULL || latency_ns == NULL) {
+        perror("Unable to allocate latency samples");
+        return 1;
+    }
+
+    pthread_t producer_threads[MAX_THREADS], consumer_threads[MAX_THREADS];
+    uint64_t start = now_ns();
+    for (int i = 0; i < num_consumers; i++) {
+        pthread_create(&consumer_threads[i], NULL, throughput_consumer, NULL);
+    }
+    for (int i = 0; i < num_producers; i++) {
+        pthread_create(&producer_threads[i], NULL, throughput_producer, (void *)(intptr_t)i);
+    }
+    for (int i = 0; i < num_producers; i++) {
+        pthread_join(producer_threads[i], NULL);
+    }
+    for (int i = 0; i < num_consumers; i++) {
+        put(END_OF_STREAM);
+    }
+    for (int i = 0; i < num_consumers; i++) {
+        pthread_join(consumer_threads[i], NULL);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    qsort(latency_ns, samples, sizeof(uint64_t), compare_u64);
+    printf("Queue: %s, wait: %s, producers: %d, consumers: %d\n",
+           use_mpmc ? "mpmc" : "spsc", wait_strategy_name(wait_strategy),
+           num_producers, num_consumers);
+    printf("Capacity: %zu, batch: %zu, items: %ld\n",
+           use_mpmc ? work_queue.capacity : buffer.capacity, batch_size, throughput_items);
+    printf("Elapsed: %.3f s, throughput: %.0f items/sec\n",
+           elapsed / 1e9, throughput_items / (elapsed / 1e9));
+    printf("Handoff latency p50: %llu ns, p99: %llu ns (%zu samples)\n",
+           (unsigned long long)latency_ns[samples / 2],
+           (unsigned long long)latency_ns[samples * 99 / 100], samples);
+
+    free(sent_ns);
+    free(latency_ns);
+    return 0;
+}
+
+void print_usage(const char *program) {
+    printf("Usage: %s [--capacity N] [--batch N] [--no-sleep] [--throughput ITEMS]\n", program);
+    printf("          [--producers N] [--consumers M] [--wait spin|hybrid|condvar] [--mpmc]\n");
+    printf("  --capacity N       Buffer slots, must be a power of two (default %d)\n", DEFAULT_CAPACITY);
+    printf("  --batch N          Items moved per put_n/get_n call (default %d)\n", DEFAULT_BATCH);
+    printf("  --no-sleep         Do not sleep(1) between items in the demo\n");
+    printf("  --throughput ITEMS Move ITEMS items as fast as possible and report items/sec and latency\n");
+    printf("  --producers N      Number of producer threads (default 1)\n");
+    printf("  --consumers M      Number of consumer threads (default 1)\n");
+    printf("  --wait STRATEGY    How threads wait on a full or empty queue (default hybrid)\n");
+    printf("  --mpmc             Use the multi-producer queue even with one producer and consumer\n");
+    printf("Use --capacity 1 to reproduce the old single-slot handoff for comparison.\n");
+}
+
+int main(int argc, char *argv[]) {
+    size_t capacity = DEFAULT_CAPACITY;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--capacity") == 0 && i + 1 < argc) {
+            capacity = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_size = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--no-sleep") == 0) {
+            sleep_enabled = false;
+        } else if (strcmp(argv[i], "--throughput") == 0 && i + 1 < argc) {
+            throughput_items = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--producers") == 0 && i + 1 < argc) {
+            num_producers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--consumers") == 0 && i + 1 < argc) {
+            num_consumers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mpmc") == 0) {
+            use_mpmc = true;
+        } else if (strcmp(argv[i], "--wait") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "spin") == 0) {
+                wait_strategy = WAIT_SPIN;
+            } else if (strcmp(argv[i], "hybrid") == 0) {
+                wait_strategy = WAIT_HYBRID;
+            } else if (strcmp(argv[i], "condvar") == 0) {
+                wait_strategy = WAIT_CONDVAR;
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    // Items are ints numbered from 0, so larger counts would wrap into END_OF_STREAM
+    if (throughput_items < 0 || throughput_items > INT_MAX) {
+        fprintf(stderr, "Throughput item count must be at most %d\n", INT_MAX);
+        return 1;
+    }
+    if (batch_size == 0 || batch_size > MAX_BATCH) {
+        fprintf(stderr, "Batch size must be between 1 and %d\n", MAX_BATCH);
+        return 1;
+    }
+    if (num_producers < 1 || num_producers > MAX_THREADS ||
+        num_consumers < 1 || num_consumers > MAX_THREADS) {
+        fprintf(stderr, "Producer and consumer counts must be between 1 and %d\n", MAX_THREADS);
+        return 1;
+    }
+    if (num_producers > 1 || num_consumers > 1) {
+        use_mpmc = true;
+    }
+    if (use_mpmc ? queue_init(&work_queue, capacity) != 0 : ring_init(&buffer, capacity) != 0) {
+        return 1;
+    }
+    wait_point_init(&items_available);
+    wait_point_init(&space_available);
+
+    if (throughput_items > 0) {
+        int result = run_throughput();
+        if (use_mpmc) {
+            queue_destroy(&work_queue);
+        } else {
+            ring_destroy(&buffer);
+        }
+        wait_point_destroy(&items_available);
+        wait_point_destroy(&space_available);
+        return result;
+    }
+
+    pthread_t producer_threads[MAX_THREADS], consumer_threads[MAX_THREADS];
+
+    // Create the producer threads
+    for (int i = 0; i < num_producers; i++) {
+        pthread_create(&producer_threads[i], NULL, producer, NULL);
+    }
+
+    // Create the consumer threads
+    for (int i = 0; i < num_consumers; i++) {
+        pthread_create(&consumer_threads[i], NULL, consumer, NULL);
+    }
 
     // Join the threads (this will wait for them to finish, which they won't in this infinite loop case)
-    pthread_join(producer_thread, NULL);
-    pthread_join(consumer_thread, NULL);
+    for (int i = 0; i < num_producers; i++) {
+        pthread_join(producer_threads[i], NULL);
+    }
+    for (int i = 0; i < num_consumers; i++) {
+        pthread_join(consumer_threads[i], NULL);
+    }
 
     return 0;
 }
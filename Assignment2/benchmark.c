@@ -0,0 +1,339 @@
+// Joseph Clauss
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_LINE_SIZE 64
+#define MAX_THREADS 256
+#define INITIAL_BALANCE 1000
+#define MAX_AMOUNT 300
+#define REPORT_EVERY 64        // Ops a thread runs between checks of the shared op budget
+#define SPINS_BEFORE_YIELD 128 // Spin iterations before a lock waiter yields the CPU
+
+typedef enum {
+    PRIM_MUTEX,
+    PRIM_SEMAPHORE,
+    PRIM_SPINLOCK,
+    PRIM_TICKET,
+    PRIM_ATOMIC,
+    PRIM_COUNT
+} Primitive;
+
+const char *primitive_names[PRIM_COUNT] = {"mutex", "semaphore", "spinlock", "ticket", "atomic"};
+
+// Test-and-test-and-set spinlock
+typedef struct {
+    atomic_bool locked;
+} SpinLock;
+
+// FIFO ticket lock: threads are served in the order they took a ticket
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_uint next_ticket;
+    _Alignas(CACHE_LINE_SIZE) atomic_uint now_serving;
+} TicketLock;
+
+// Per-thread results, padded so counters never share a cache line
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) long ops;
+    long deposited;
+    long withdrawn;
+    long failed_withdrawals;
+    int index;
+} ThreadStats;
+
+// Shared bank account balance and its guards
+_Alignas(CACHE_LINE_SIZE) long balance = INITIAL_BALANCE;
+_Alignas(CACHE_LINE_SIZE) atomic_long atomic_balance = INITIAL_BALANCE;
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+sem_t semaphore;
+SpinLock spinlock;
+TicketLock ticket_lock;
+
+// Benchmark configuration
+Primitive primitive;
+long total_ops = 1000000;
+int deposit_percent = 50;
+_Alignas(CACHE_LINE_SIZE) atomic_long ops_done;
+atomic_bool start_flag;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void cpu_relax(unsigned *spins) {
+    if (++(*spins) < SPINS_BEFORE_YIELD) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else {
+        *spins = 0;
+        sched_yield();
+    }
+}
+
+// Small per-thread xorshift generator so the workload itself is not a bottleneck
+static uint32_t next_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+void spin_lock(SpinLock *lock) {
+    unsigned spins = 0;
+    while (atomic_exchange_explicit(&lock->locked, true, memory_order_acquire)) {
+        while (atomic_load_explicit(&lock->locked, memory_order_relaxed)) {
+            cpu_relax(&spins);
+        }
+    }
+}
+
+void spin_unlock(SpinLock *lock) {
+    atomic_store_explicit(&lock->locked, false, memory_order_release);
+}
+
+void ticket_lock_acquire(TicketLock *lock) {
+    unsigned spins = 0;
+    unsigned ticket = atomic_fetch_add_explicit(&lock->next_ticket, 1, memory_order_relaxed);
+    while (atomic_load_explicit(&lock->now_serving, memory_order_acquire) != ticket) {
+        cpu_relax(&spins);
+    }
+}
+
+void ticket_lock_release(TicketLock *lock) {
+    unsigned next = atomic_load_explicit(&lock->now_serving, memory_order_relaxed) + 1;
+    atomic_store_explicit(&lock->now_serving, next, memory_order_release);
+}
+
+void lock_account() {
+    switch (primitive) {
+    case PRIM_MUTEX:
+        pthread_mutex_lock(&mutex);
+        break;
+    case PRIM_SEMAPHORE:
+        sem_wait(&semaphore);
+        break;
+    case PRIM_SPINLOCK:
+        spin_lock(&spinlock);
+        break;
+    case PRIM_TICKET:
+        ticket_lock_acquire(&ticket_lock);
+        break;
+    default:
+        break;
+    }
+}
+
+void unlock_account() {
+    switch (primitive) {
+    case PRIM_MUTEX:
+        pthread_mutex_unlock(&mutex);
+        break;
+    case PRIM_SEMAPHORE:
+        sem_post(&semaphore);
+        break;
+    case PRIM_SPINLOCK:
+        spin_unlock(&spinlock);
+        break;
+    case PRIM_TICKET:
+        ticket_lock_release(&ticket_lock);
+        break;
+    default:
+        break;
+    }
+}
+
+void deposit(ThreadStats *stats, int amount) {
+    if (primitive == PRIM_ATOMIC) {
+        atomic_fetch_add_explicit(&atomic_balance, amount, memory_order_relaxed);
+    } else {
+        lock_account();
+        balance += amount;
+        unlock_account();
+    }
+    stats->deposited += amount;
+}
+
+void withdraw(ThreadStats *stats, int amount) {
+    bool ok;
+    if (primitive == PRIM_ATOMIC) {
+        long current = atomic_load_explicit(&atomic_balance, memory_order_relaxed);
+        do {
+            ok = current >= amount;
+        } while (ok && !atomic_compare_exchange_weak_explicit(&atomic_balance, &current, current - amount,
+                                                              memory_order_relaxed, memory_order_relaxed));
+    } else {
+        lock_account();
+        ok = balance >= amount;
+        if (ok) {
+            balance -= amount;
+        }
+        unlock_account();
+    }
+    if (ok) {
+        stats->withdrawn += amount;
+    } else {
+        stats->failed_withdrawals++;
+    }
+}
+
+// Worker: runs deposits and withdrawals until the shared op budget is used up
+void *worker(void *arg) {
+    ThreadStats *stats = (ThreadStats *)arg;
+    uint32_t rng = 2463534242u + 7919u * (uint32_t)stats->index;
+    unsigned spins = 0;
+
+    while (!atomic_load_explicit(&start_flag, memory_order_acquire)) {
+        cpu_relax(&spins);
+    }
+    for (;;) {
+        for (int i = 0; i < REPORT_EVERY; i++) {
+            uint32_t r = next_random(&rng);
+            int amount = (int)(r % MAX_AMOUNT) + 1;
+            if ((int)((r >> 16) % 100) < deposit_percent) {
+                deposit(stats, amount);
+            } else {
+                withdraw(stats, amount);
+            }
+        }
+        stats->ops += REPORT_EVERY;
+        if (atomic_fetch_add_explicit(&ops_done, REPORT_EVERY, memory_order_relaxed) + REPORT_EVERY >= total_ops) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Run the workload once with the given primitive and thread count and print one result row
+void run_benchmark(Primitive prim, int num_threads) {
+    pthread_t threads[MAX_THREADS];
+    ThreadStats *stats = aligned_alloc(CACHE_LINE_SIZE, sizeof(ThreadStats) * num_threads);
+    if (stats == NULL) {
+        perror("Unable to allocate thread counters");
+        exit(EXIT_FAILURE);
+    }
+
+    primitive = prim;
+    balance = INITIAL_BALANCE;
+    atomic_store(&atomic_balance, INITIAL_BALANCE);
+    atomic_store(&ops_done, 0);
+    atomic_store(&start_flag, false);
+    for (int i = 0; i < num_threads; i++) {
+        memset(&stats[i], 0, sizeof(ThreadStats));
+        stats[i].index = i;
+        pthread_create(&threads[i], NULL, worker, &stats[i]);
+    }
+
+    uint64_t start = now_ns();
+    atomic_store_explicit(&start_flag, true, memory_order_release);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    long ops = 0, min_ops = stats[0].ops, max_ops = stats[0].ops, failed = 0;
+    long expected = INITIAL_BALANCE;
+    double sum = 0, sum_squares = 0;
+    for (int i = 0; i < num_threads; i++) {
+        ops += stats[i].ops;
+        failed += stats[i].failed_withdrawals;
+        expected += stats[i].deposited - stats[i].withdrawn;
+        min_ops = stats[i].ops < min_ops ? stats[i].ops : min_ops;
+        max_ops = stats[i].ops > max_ops ? stats[i].ops : max_ops;
+        sum += stats[i].ops;
+        sum_squares += (double)stats[i].ops * stats[i].ops;
+    }
+    // Jain's fairness index: 1.0 when every thread did the same number of ops
+    double fairness = sum_squares > 0 ? (sum * sum) / (num_threads * sum_squares) : 1.0;
+    long final_balance = prim == PRIM_ATOMIC ? atomic_load(&atomic_balance) : balance;
+
+    printf("%-10s %7d %14.0f %10ld %10ld %9.3f %9ld  %s\n",
+           primitive_names[prim], num_threads, ops / seconds, min_ops, max_ops, fairness,
+           failed, final_balance == expected ? "ok" : "MISMATCH");
+    free(stats);
+}
+
+void print_usage(const char *program) {
+    printf("Usage: %s [--threads N] [--ops N] [--deposit-percent P] [--primitive NAME|all] [--exact]\n", program);
+    printf("  --threads N          Highest thread count; runs 1, 2, 4, ... up to N (default: online CPUs)\n");
+    printf("  --ops N              Total deposit/withdraw operations per run (default %ld)\n", total_ops);
+    printf("  --deposit-percent P  Share of operations that are deposits (default %d)\n", deposit_percent);
+    printf("  --primitive NAME     mutex, semaphore, spinlock, ticket, atomic or all (default all)\n");
+    printf("  --exact              Run every thread count from 1 to N instead of powers of two\n");
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int selected = -1; // -1 runs every primitive
+    bool exact = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            max_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+            total_ops = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--deposit-percent") == 0 && i + 1 < argc) {
+            deposit_percent = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--exact") == 0) {
+            exact = true;
+        } else if (strcmp(argv[i], "--primitive") == 0 && i + 1 < argc) {
+            i++;
+            selected = -2;
+            if (strcmp(argv[i], "all") == 0) {
+                selected = -1;
+            }
+            for (int p = 0; p < PRIM_COUNT; p++) {
+                if (strcmp(argv[i], primitive_names[p]) == 0) {
+                    selected = p;
+                }
+            }
+            if (selected == -2) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (max_threads < 1 || max_threads > MAX_THREADS) {
+        fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_THREADS);
+        return 1;
+    }
+    if (deposit_percent < 0 || deposit_percent > 100 || total_ops < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    sem_init(&semaphore, 0, 1);
+    printf("Ops per run: %ld, deposits: %d%%, online CPUs: %ld\n",
+           total_ops, deposit_percent, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-10s %7s %14s %10s %10s %9s %9s  %s\n",
+           "primitive", "threads", "ops/sec", "min ops", "max ops", "fairness", "failed", "balance");
+    for (int p = 0; p < PRIM_COUNT; p++) {
+        if (selected >= 0 && selected != p) {
+            continue;
+        }
+        for (int t = 1;; ) {
+            run_benchmark((Primitive)p, t);
+            if (t == max_threads) {
+                break;
+            }
+            // Always finish with a row for exactly max_threads
+            t = exact ? t + 1 : (t * 2 > max_threads ? max_threads : t * 2);
+        }
+    }
+    sem_destroy(&semaphore);
+    return 0;
+}
@@ -1,18 +1,188 @@
 // Joseph Clauss
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_LINE_SIZE 64
+#define MAX_THREADS 256
+#define DEFAULT_ACCOUNTS 4096
+#define DEFAULT_STRIPES 256
+#define INITIAL_ACCOUNT_BALANCE 1000
+#define MAX_TRANSFER_AMOUNT 300
+#define MAX_TRANSFER_BATCH 64
+#define WITHDRAW_TIMEOUT_MS 1000
 
 int balance = 1000; // Shared bank account balance
 pthread_mutex_t mutex;
-pthread_cond_t cond;
+pthread_condattr_t cond_attr; // Waiter condition variables time out on CLOCK_MONOTONIC
+
+// A withdrawal sleeping until the balance can cover it. Each waiter has its
+// own condition variable so a deposit can wake exactly the threads it can pay.
+typedef struct Waiter {
+    pthread_cond_t cond;
+    bool signaled; // Set by a deposit that reserved funds for this waiter
+    struct Waiter *next;
+} Waiter;
+
+// FIFO of waiters that all want the same amount, kept in a list sorted by amount
+typedef struct WaitQueue {
+    int amount;
+    Waiter *head;
+    Waiter *tail;
+    struct WaitQueue *next;
+} WaitQueue;
+
+WaitQueue *wait_queues = NULL;
+bool wake_all_waiters = false; // Wake every waiter on each deposit, for comparison
+
+// Wait statistics, protected by mutex
+long total_wakeups = 0;
+long spurious_wakeups = 0; // Woken up but the balance still could not cover the withdrawal
+long withdraw_timeouts = 0;
+double *wait_samples = NULL; // Seconds spent waiting by each withdrawal that had to wait
+long wait_sample_count = 0;
+long wait_sample_capacity = 0;
+
+static double monotonic_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Add a waiter to the queue for its amount, creating the queue if needed. Caller holds mutex.
+static void add_waiter(int amount, Waiter *waiter) {
+    WaitQueue **link = &wait_queues;
+    while (*link != NULL && (*link)->amount < amount) {
+        link = &(*link)->next;
+    }
+    WaitQueue *queue = *link;
+    if (queue == NULL || queue->amount != amount) {
+        queue = malloc(sizeof(WaitQueue));
+        if (queue == NULL) {
+            perror("Unable to allocate wait queue");
+            exit(EXIT_FAILURE);
+        }
+        queue->amount = amount;
+        queue->head = queue->tail = NULL;
+        queue->next = *link;
+        *link = queue;
+    }
+    waiter->next = NULL;
+    if (queue->tail == NULL) {
+        queue->head = queue->tail = waiter;
+    } else {
+        queue->tail->next = waiter;
+        queue->tail = waiter;
+    }
+}
+
+// Remove a waiter from its queue, freeing the queue once it is empty. Caller holds mutex.
+static void remove_waiter(int amount, Waiter *waiter) {
+    WaitQueue **link = &wait_queues;
+    while ((*link)->amount != amount) {
+        link = &(*link)->next;
+    }
+    WaitQueue *queue = *link;
+    Waiter *prev = NULL;
+    for (Waiter *current = queue->head; current != waiter; current = current->next) {
+        prev = current;
+    }
+    if (prev == NULL) {
+        queue->head = waiter->next;
+    } else {
+        prev->next = waiter->next;
+    }
+    if (queue->tail == waiter) {
+        queue->tail = prev;
+    }
+    if (queue->head == NULL) {
+        *link = queue->next;
+        free(queue);
+    }
+}
+
+// Wake the waiters the current balance can pay for, smallest amounts first.
+// Waiters already signaled keep their share reserved. Caller holds mutex.
+static void wake_satisfiable_waiters() {
+    long available = balance;
+    for (WaitQueue *queue = wait_queues; queue != NULL; queue = queue->next) {
+        for (Waiter *waiter = queue->head; waiter != NULL; waiter = waiter->next) {
+            if (!wake_all_waiters && queue->amount > available) {
+                return;
+            }
+            if (!waiter->signaled) {
+                waiter->signaled = true;
+                pthread_cond_signal(&waiter->cond);
+            }
+            available -= queue->amount;
+        }
+    }
+}
+
+// Block until the balance covers amount. Caller holds mutex, which is still held
+// on return. A negative timeout waits forever. Returns 0 once the funds are
+// there, or -1 if the timeout expired first.
+int wait_for_funds(int amount, long timeout_ms) {
+    if (balance >= amount) {
+        return 0;
+    }
+
+    Waiter waiter;
+    pthread_cond_init(&waiter.cond, &cond_attr);
+    waiter.signaled = false;
+    add_waiter(amount, &waiter);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    double start = monotonic_seconds();
+    int result = 0;
+    while (balance < amount) {
+        int rc = timeout_ms < 0 ? pthread_cond_wait(&waiter.cond, &mutex)
+                                : pthread_cond_timedwait(&waiter.cond, &mutex, &deadline);
+        if (rc == ETIMEDOUT) {
+            if (balance < amount) {
+                withdraw_timeouts++;
+                result = -1;
+            }
+            break;
+        }
+        total_wakeups++;
+        if (balance < amount) {
+            spurious_wakeups++;
+            waiter.signaled = false;
+        }
+    }
+    remove_waiter(amount, &waiter);
+    if (result != 0 && waiter.signaled) {
+        wake_satisfiable_waiters(); // Hand the funds reserved for us to someone else
+    }
+    pthread_cond_destroy(&waiter.cond);
+
+    if (result == 0 && wait_sample_count < wait_sample_capacity) {
+        wait_samples[wait_sample_count++] = monotonic_seconds() - start;
+    }
+    return result;
+}
 
 void* deposit(void* amount) {
     int deposit_amount = *((int*)amount);
     pthread_mutex_lock(&mutex); // Acquire lock
     balance += deposit_amount;
     printf("Deposited %d, new balance: %d\n", deposit_amount, balance);
-    pthread_cond_signal(&cond);
+    wake_satisfiable_waiters();
     pthread_mutex_unlock(&mutex); // Release lock
     return NULL;
 }
@@ -20,23 +190,357 @@ void* deposit(void* amount) {
 void* withdraw(void* amount) {
     int withdraw_amount = *((int*)amount);
     pthread_mutex_lock(&mutex); // Acquire lock
-    if (balance >= withdraw_amount) {
+    if (wait_for_funds(withdraw_amount, WITHDRAW_TIMEOUT_MS) == 0) {
         balance -= withdraw_amount;
         printf("Withdrew %d, new balance: %d\n", withdraw_amount, balance);
     } else {
-        printf("Insufficient funds for withdrawal of %d\n", withdraw_amount);
+        printf("Timed out waiting for funds for withdrawal of %d\n", withdraw_amount);
     }
-    pthread_cond_signal(&cond);
     pthread_mutex_unlock(&mutex); // Release lock
     return NULL;
 }
 
-int main() {
-    pthread_t threads[4];
-    int amounts[4] = {200, 150, 300, 100};
+// Sharded multi-account ledger.
+// Accounts are spread over stripes, each guarded by its own mutex. Running
+// with one stripe is the same as the single global lock used above.
+typedef struct {
+    long balance;
+} Account;
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+} Stripe;
+
+typedef struct {
+    int from;
+    int to;
+    long amount;
+} Transfer;
+
+Account *accounts;
+Stripe *stripes;
+int num_accounts = DEFAULT_ACCOUNTS;
+int num_stripes = DEFAULT_STRIPES;
+
+static inline int stripe_of(int account) {
+    return account % num_stripes;
+}
+
+int ledger_init(int account_count, int stripe_count, long initial_balance) {
+    accounts = malloc(sizeof(Account) * account_count);
+    stripes = aligned_alloc(CACHE_LINE_SIZE, sizeof(Stripe) * stripe_count);
+    if (accounts == NULL || stripes == NULL) {
+        perror("Unable to allocate ledger");
+        return -1;
+    }
+    num_accounts = account_count;
+    num_stripes = stripe_count;
+    for (int i = 0; i < num_accounts; i++) {
+        accounts[i].balance = initial_balance;
+    }
+    for (int i = 0; i < num_stripes; i++) {
+        pthread_mutex_init(&stripes[i].lock, NULL);
+    }
+    return 0;
+}
+
+void ledger_destroy() {
+    for (int i = 0; i < num_stripes; i++) {
+        pthread_mutex_destroy(&stripes[i].lock);
+    }
+    free(accounts);
+    free(stripes);
+}
 
+// Move amount between two accounts. Stripes are always locked in ascending
+// order so two opposite transfers can never deadlock.
+int ledger_transfer(int from, int to, long amount) {
+    int first = stripe_of(from), second = stripe_of(to);
+    if (first > second) {
+        int temp = first;
+        first = second;
+        second = temp;
+    }
+    pthread_mutex_lock(&stripes[first].lock);
+    if (second != first) {
+        pthread_mutex_lock(&stripes[second].lock);
+    }
+    int result = -1;
+    if (accounts[from].balance >= amount) {
+        accounts[from].balance -= amount;
+        accounts[to].balance += amount;
+        result = 0;
+    }
+    if (second != first) {
+        pthread_mutex_unlock(&stripes[second].lock);
+    }
+    pthread_mutex_unlock(&stripes[first].lock);
+    return result;
+}
+
+// Apply a batch of transfers, locking every stripe the batch touches exactly
+// once and in ascending order. Returns the number of transfers that succeeded.
+int ledger_transfer_batch(const Transfer *batch, int count) {
+    int touched[2 * MAX_TRANSFER_BATCH];
+    int num_touched = 0;
+    if (count > MAX_TRANSFER_BATCH) {
+        count = MAX_TRANSFER_BATCH;
+    }
+    for (int i = 0; i < count; i++) {
+        touched[num_touched++] = stripe_of(batch[i].from);
+        touched[num_touched++] = stripe_of(batch[i].to);
+    }
+    for (int i = 1; i < num_touched; i++) { // Insertion sort, batches are small
+        int value = touched[i], j = i - 1;
+        while (j >= 0 && touched[j] > value) {
+            touched[j + 1] = touched[j];
+            j--;
+        }
+        touched[j + 1] = value;
+    }
+    int unique = 0;
+    for (int i = 0; i < num_touched; i++) {
+        if (unique == 0 || touched[unique - 1] != touched[i]) {
+            touched[unique++] = touched[i];
+        }
+    }
+
+    for (int i = 0; i < unique; i++) {
+        pthread_mutex_lock(&stripes[touched[i]].lock);
+    }
+    int succeeded = 0;
+    for (int i = 0; i < count; i++) {
+        if (accounts[batch[i].from].balance >= batch[i].amount) {
+            accounts[batch[i].from].balance -= batch[i].amount;
+            accounts[batch[i].to].balance += batch[i].amount;
+            succeeded++;
+        }
+    }
+    for (int i = unique - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&stripes[touched[i]].lock);
+    }
+    return succeeded;
+}
+
+// Ledger benchmark settings
+long ledger_ops = 1000000;
+int transfer_batch_size = 1;
+int ledger_threads = 1;
+long transfers_done[MAX_THREADS]; // Transfers each worker ran, written when it finishes
+
+// Small per-thread xorshift generator so picking accounts is not a bottleneck
+static uint32_t next_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// Worker that runs its share of the random transfers
+void *ledger_worker(void *arg) {
+    int index = (int)(intptr_t)arg;
+    uint32_t rng = 2463534242u + 7919u * (uint32_t)index;
+    Transfer batch[MAX_TRANSFER_BATCH];
+    long done = 0;
+    for (; done < ledger_ops / ledger_threads; done += transfer_batch_size) {
+        for (int i = 0; i < transfer_batch_size; i++) {
+            batch[i].from = next_random(&rng) % num_accounts;
+            batch[i].to = next_random(&rng) % num_accounts;
+            batch[i].amount = next_random(&rng) % MAX_TRANSFER_AMOUNT + 1;
+        }
+        if (transfer_batch_size == 1) {
+            ledger_transfer(batch[0].from, batch[0].to, batch[0].amount);
+        } else {
+            ledger_transfer_batch(batch, transfer_batch_size);
+        }
+    }
+    transfers_done[index] = done;
+    return NULL;
+}
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Run one configuration of the ledger benchmark and print a result row
+void run_ledger_benchmark(int stripe_count, int num_threads) {
+    pthread_t threads[MAX_THREADS];
+    if (ledger_init(num_accounts, stripe_count, INITIAL_ACCOUNT_BALANCE) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    ledger_threads = num_threads;
+
+    double start = now_seconds();
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, ledger_worker, (void *)(intptr_t)i);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+
+    long total = 0, transfers = 0;
+    for (int i = 0; i < num_accounts; i++) {
+        total += accounts[i].balance;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        transfers += transfers_done[i];
+    }
+    printf("%-8d %8d %14.0f  %s\n", stripe_count, num_threads, transfers / elapsed,
+           total == (long)num_accounts * INITIAL_ACCOUNT_BALANCE ? "ok" : "MISMATCH");
+    ledger_destroy();
+}
+
+// Compare the single global lock (one stripe) against the striped ledger
+int run_ledger(int argc, char *argv[]) {
+    int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int stripe_count = DEFAULT_STRIPES;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--accounts") == 0 && i + 1 < argc) {
+            num_accounts = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stripes") == 0 && i + 1 < argc) {
+            stripe_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            max_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+            ledger_ops = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            transfer_batch_size = atoi(argv[++i]);
+        } else {
+            printf("Usage: %s --ledger [--accounts N] [--stripes S] [--threads T] [--ops N] [--batch B]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (num_accounts < 1 || stripe_count < 1 || max_threads < 1 || max_threads > MAX_THREADS ||
+        transfer_batch_size < 1 || transfer_batch_size > MAX_TRANSFER_BATCH) {
+        fprintf(stderr, "Invalid ledger settings\n");
+        return 1;
+    }
+
+    printf("Accounts: %d, transfers: %ld, batch: %d\n", num_accounts, ledger_ops, transfer_batch_size);
+    printf("%-8s %8s %14s  %s\n", "stripes", "threads", "transfers/sec", "total");
+    int configs[2] = {1, stripe_count};
+    for (int c = 0; c < (stripe_count == 1 ? 1 : 2); c++) {
+        for (int t = 1;; t = t * 2 > max_threads ? max_threads : t * 2) {
+            run_ledger_benchmark(configs[c], t);
+            if (t == max_threads) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+// Payment burst settings
+long burst_ops = 100000;
+long burst_timeout_ms = 100;
+
+// Payment burst worker: even thread indexes deposit, odd ones withdraw.
+// Deposits are slightly larger on average so the run does not end with
+// withdrawals stuck waiting for money that never comes.
+void *burst_worker(void *arg) {
+    int index = (int)(intptr_t)arg;
+    uint32_t rng = 2463534242u + 7919u * (uint32_t)index;
+    for (long i = 0; i < burst_ops; i++) {
+        int amount = next_random(&rng) % MAX_TRANSFER_AMOUNT + 1;
+        pthread_mutex_lock(&mutex);
+        if (index % 2 == 0) {
+            amount += amount / 10;
+            balance += amount;
+            wake_satisfiable_waiters();
+        } else if (wait_for_funds(amount, burst_timeout_ms) == 0) {
+            balance -= amount;
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Instrumented high-contention run of blocking withdrawals against deposits
+int run_contention(int argc, char *argv[]) {
+    int num_threads = 8;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+            burst_ops = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+            burst_timeout_ms = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--broadcast") == 0) {
+            wake_all_waiters = true;
+        } else {
+            printf("Usage: %s --contention [--threads N] [--ops N] [--timeout MS] [--broadcast]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (num_threads < 2 || num_threads > MAX_THREADS || burst_ops < 1) {
+        fprintf(stderr, "Invalid contention settings\n");
+        return 1;
+    }
+
+    pthread_t threads[MAX_THREADS];
+    balance = 0;
+    wait_sample_capacity = burst_ops * (num_threads / 2);
+    wait_samples = malloc(sizeof(double) * wait_sample_capacity);
+    if (wait_samples == NULL) {
+        perror("Unable to allocate wait samples");
+        exit(EXIT_FAILURE);
+    }
+
+    double start = monotonic_seconds();
+    for (int i = 1; i < num_threads; i += 2) { // Withdrawers first so they start out waiting
+        pthread_create(&threads[i], NULL, burst_worker, (void *)(intptr_t)i);
+    }
+    for (int i = 0; i < num_threads; i += 2) {
+        pthread_create(&threads[i], NULL, burst_worker, (void *)(intptr_t)i);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = monotonic_seconds() - start;
+
+    qsort(wait_samples, wait_sample_count, sizeof(double), compare_double);
+    double total_wait = 0;
+    for (long i = 0; i < wait_sample_count; i++) {
+        total_wait += wait_samples[i];
+    }
+    printf("Threads: %d, ops per thread: %ld, wakeups: %s\n", num_threads, burst_ops,
+           wake_all_waiters ? "all waiters" : "satisfiable waiters only");
+    printf("Elapsed: %.3f s, %.0f ops/sec\n", elapsed, burst_ops * num_threads / elapsed);
+    printf("Wakeups: %ld, spurious: %ld (%.1f%%), timeouts: %ld\n", total_wakeups, spurious_wakeups,
+           total_wakeups ? 100.0 * spurious_wakeups / total_wakeups : 0.0, withdraw_timeouts);
+    if (wait_sample_count > 0) {
+        printf("Waited withdrawals: %ld, wait latency avg: %.1f us, p50: %.1f us, p99: %.1f us\n",
+               wait_sample_count, total_wait / wait_sample_count * 1e6,
+               wait_samples[wait_sample_count / 2] * 1e6,
+               wait_samples[wait_sample_count * 99 / 100] * 1e6);
+    }
+    free(wait_samples);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
     pthread_mutex_init(&mutex, NULL);
-    pthread_cond_init(&cond, NULL);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+
+    if (argc > 1 && strcmp(argv[1], "--ledger") == 0) {
+        return run_ledger(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--contention") == 0) {
+        return run_contention(argc, argv);
+    }
+
+    pthread_t threads[4];
+    int amounts[4] = {200, 150, 300, 100};
 
     pthread_create(&threads[0], NULL, deposit, &amounts[0]);
     pthread_create(&threads[1], NULL, withdraw, &amounts[1]);
@@ -48,7 +552,7 @@ int main() {
     }
 
     pthread_mutex_destroy(&mutex);
-    pthread_cond_destroy(&cond);
+    pthread_condattr_destroy(&cond_attr);
     printf("Final balance: %d\n", balance);
     return 0;
 }
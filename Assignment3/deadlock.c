@@ -1,72 +1,924 @@
 //Joseph Clauss
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #define NUM_PROCESSES 5
-#define RESOURCE_AVAILABLE 1
-#define RESOURCE_UNAVAILABLE 0
+#define NUM_RESOURCES 2
 #define TIMEOUT 5
+#define TRYLOCK_ATTEMPTS 6    // Try-lock attempts before sleeping on the resource's condvar
+#define BACKOFF_START_US 1000 // First backoff delay, doubled after each failed try-lock
+#define MAX_HELD 8 // Most resources a simulated process can hold at once
+#define VECTOR_WIDTH 8 // Resource vectors are padded to a multiple of this many lanes
+
+// A shared resource with its own lock. The lock only protects the fields;
+// ownership is the owner field, so nobody holds a mutex while using it.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    int owner; // Index of the owning process, -1 when free
+
+    // Contention profile, updated under lock
+    uint64_t acquired_at;
+    long acquisitions;
+    long contended_acquisitions; // Acquisitions that had to back off or wait
+    long timeouts;
+    atomic_long trylock_failures;
+    uint64_t total_wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t total_hold_ns;
+    uint64_t max_hold_ns;
+} Resource;
 
 typedef struct {
     int id;
-    int resource_status;
     int timer;
+    unsigned seed;
 } Process;
 
 Process processes[NUM_PROCESSES];
-pthread_mutex_t resource_mutex;
-int running = 1; // Global variable to control the running state
+Resource resources[NUM_RESOURCES];
+atomic_bool running = true; // Controls the running state, read by every thread
+pthread_mutex_t shutdown_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t shutdown_cond;
 
-void* process_function(void* arg) {
-    Process* process = (Process*)arg;
-    while (running) {
-        pthread_mutex_lock(&resource_mutex);
-        if (process->resource_status == RESOURCE_AVAILABLE) {
-            printf("Process %d acquired the resource\n", process->id);
-            process->resource_status = RESOURCE_UNAVAILABLE;
-            sleep(rand() % 3 + 1); // Simulate resource usage
-            process->resource_status = RESOURCE_AVAILABLE;
-            printf("Process %d released the resource\n", process->id);
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static struct timespec deadline_after_ms(long ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+void resource_init(Resource *resource) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    memset(resource, 0, sizeof(Resource));
+    pthread_mutex_init(&resource->lock, NULL);
+    pthread_cond_init(&resource->released, &attr);
+    pthread_condattr_destroy(&attr);
+    resource->owner = -1;
+}
+
+void resource_destroy(Resource *resource) {
+    pthread_mutex_destroy(&resource->lock);
+    pthread_cond_destroy(&resource->released);
+}
+
+// Wait for up to ms milliseconds, returning early if the program is quitting
+void simulate_work(long ms) {
+    struct timespec deadline = deadline_after_ms(ms);
+    pthread_mutex_lock(&shutdown_mutex);
+    while (atomic_load(&running) &&
+           pthread_cond_timedwait(&shutdown_cond, &shutdown_mutex, &deadline) == 0) {
+    }
+    pthread_mutex_unlock(&shutdown_mutex);
+}
+
+// Record a grant in the profile. Caller holds resource->lock.
+static void grant_resource(Resource *resource, int owner, uint64_t wait_start, bool contended) {
+    uint64_t now = now_ns(), waited = now - wait_start;
+    resource->owner = owner;
+    resource->acquired_at = now;
+    resource->acquisitions++;
+    resource->contended_acquisitions += contended;
+    resource->total_wait_ns += waited;
+    if (waited > resource->max_wait_ns) {
+        resource->max_wait_ns = waited;
+    }
+}
+
+// Take ownership of a resource. First try-lock with exponential backoff, then
+// sleep on the resource's condvar until it is released, counting one timer
+// tick per second of waiting. Returns 0 once owned, or -1 after TIMEOUT ticks
+// or when the program is quitting.
+int acquire_with_backoff(Process *process, int r) {
+    Resource *resource = &resources[r];
+    int index = process - processes;
+    uint64_t start = now_ns();
+
+    for (int attempt = 0; attempt < TRYLOCK_ATTEMPTS && atomic_load(&running); attempt++) {
+        if (pthread_mutex_trylock(&resource->lock) == 0) {
+            if (resource->owner == -1) {
+                grant_resource(resource, index, start, attempt > 0);
+                pthread_mutex_unlock(&resource->lock);
+                return 0;
+            }
+            pthread_mutex_unlock(&resource->lock);
         } else {
-            if (process->timer >= TIMEOUT) {
-                printf("Process %d is terminated due to timeout\n", process->id);
-                process->timer = 0;
-            } else {
-                process->timer++;
-                printf("Process %d is waiting for the resource, timer: %d\n", process->id, process->timer);
+            atomic_fetch_add(&resource->trylock_failures, 1);
+        }
+        usleep(BACKOFF_START_US << attempt);
+    }
+
+    pthread_mutex_lock(&resource->lock);
+    struct timespec tick = deadline_after_ms(1000);
+    while (resource->owner != -1 && atomic_load(&running)) {
+        if (pthread_cond_timedwait(&resource->released, &resource->lock, &tick) != 0) {
+            if (resource->owner == -1) {
+                break; // Released while the wait was timing out: take it rather than give up
             }
+            if (++process->timer >= TIMEOUT) {
+                resource->timeouts++;
+                pthread_mutex_unlock(&resource->lock);
+                return -1;
+            }
+            printf("Process %d is waiting for resource %d, timer: %d\n", process->id, r + 1, process->timer);
+            tick = deadline_after_ms(1000);
+        }
+    }
+    if (!atomic_load(&running)) {
+        pthread_mutex_unlock(&resource->lock);
+        return -1;
+    }
+    grant_resource(resource, index, start, true);
+    pthread_mutex_unlock(&resource->lock);
+    return 0;
+}
+
+void release(int r) {
+    Resource *resource = &resources[r];
+    pthread_mutex_lock(&resource->lock);
+    uint64_t held = now_ns() - resource->acquired_at;
+    resource->total_hold_ns += held;
+    if (held > resource->max_hold_ns) {
+        resource->max_hold_ns = held;
+    }
+    resource->owner = -1;
+    pthread_cond_signal(&resource->released);
+    pthread_mutex_unlock(&resource->lock);
+}
+
+void* process_function(void* arg) {
+    Process* process = (Process*)arg;
+    while (atomic_load(&running)) {
+        int r = rand_r(&process->seed) % NUM_RESOURCES;
+        if (acquire_with_backoff(process, r) == 0) {
+            printf("Process %d acquired resource %d\n", process->id, r + 1);
+            process->timer = 0;
+            simulate_work((rand_r(&process->seed) % 3 + 1) * 1000); // Simulate resource usage
+            release(r);
+            printf("Process %d released resource %d\n", process->id, r + 1);
+        } else if (atomic_load(&running)) {
+            printf("Process %d is terminated due to timeout\n", process->id);
+            process->timer = 0;
         }
-        pthread_mutex_unlock(&resource_mutex);
-        sleep(1); // Simulate some time before the next attempt
+        simulate_work(1000); // Simulate some time before the next attempt
     }
     return NULL;
 }
 
 void quit_program() {
-    running = 0; // Set running to 0 to stop the threads
+    atomic_store(&running, false); // Stop the threads and wake any that are waiting
+    pthread_mutex_lock(&shutdown_mutex);
+    pthread_cond_broadcast(&shutdown_cond);
+    pthread_mutex_unlock(&shutdown_mutex);
+    for (int i = 0; i < NUM_RESOURCES; i++) {
+        pthread_mutex_lock(&resources[i].lock);
+        pthread_cond_broadcast(&resources[i].released);
+        pthread_mutex_unlock(&resources[i].lock);
+    }
+}
+
+// Print where the processes spent their time for every resource
+void print_contention_profile() {
+    printf("\nContention profile:\n");
+    printf("%-8s %8s %9s %8s %9s %12s %12s %12s %12s\n", "resource", "acquired", "contended",
+           "timeouts", "trylock x", "avg wait ms", "max wait ms", "avg hold ms", "max hold ms");
+    for (int i = 0; i < NUM_RESOURCES; i++) {
+        Resource *resource = &resources[i];
+        long n = resource->acquisitions;
+        printf("%-8d %8ld %9ld %8ld %9ld %12.2f %12.2f %12.2f %12.2f\n", i + 1, n,
+               resource->contended_acquisitions, resource->timeouts, atomic_load(&resource->trylock_failures),
+               n ? resource->total_wait_ns / 1e6 / n : 0.0, resource->max_wait_ns / 1e6,
+               n ? resource->total_hold_ns / 1e6 / n : 0.0, resource->max_hold_ns / 1e6);
+    }
+}
+
+// Deadlock detection mode.
+// Simulated processes repeatedly grab a few random resources in random order,
+// work while holding them, then release them. Each resource has its own lock.
+// Blocking and granting update a resource-allocation graph (process -> resource
+// it waits on, resource -> process that owns it) and a background detector
+// looks for cycles in that graph and aborts the cheapest process in each one.
+typedef struct {
+    int id;
+    int waiting_on;          // Resource the process is blocked on, -1 when running
+    int held[MAX_HELD];
+    int held_count;
+    bool abort_requested;    // Set by the detector when this process is the victim
+    uint64_t blocked_since;  // When the current wait started
+    uint64_t job_start;      // When the current job started, used as its cost
+    long jobs_completed;
+    long jobs_aborted;
+    unsigned seed;
+} SimProcess;
+
+Resource *sim_resources;
+SimProcess *sim_processes;
+int num_sim_processes = NUM_PROCESSES;
+int num_sim_resources = NUM_PROCESSES;
+int resources_per_job = 2;
+int work_us = 1000;
+int detect_interval_ms = 10;
+bool verbose = false;
+atomic_bool sim_running;
+
+// Protects waiting_on and owner so the detector always sees a consistent graph.
+// Always taken after a resource lock, never before one.
+pthread_mutex_t graph_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Detector statistics
+long deadlocks_detected = 0;
+uint64_t total_detection_latency = 0;
+uint64_t max_detection_latency = 0;
+uint64_t time_lost_to_deadlocks = 0; // Process time spent stuck in cycles plus discarded work
+
+// Block until the resource is ours. Returns 0 once granted, or -1 if the
+// detector picked this process as a victim or the simulation is stopping.
+int acquire_resource(SimProcess *process, int r) {
+    Resource *resource = &sim_resources[r];
+    int index = process - sim_processes;
+    pthread_mutex_lock(&resource->lock);
+    if (resource->owner != -1) {
+        pthread_mutex_lock(&graph_mutex);
+        process->waiting_on = r;
+        process->blocked_since = now_ns();
+        pthread_mutex_unlock(&graph_mutex);
+        while (resource->owner != -1 && !process->abort_requested && atomic_load(&sim_running)) {
+            pthread_cond_wait(&resource->released, &resource->lock);
+        }
+    }
+    int result = -1;
+    pthread_mutex_lock(&graph_mutex);
+    process->waiting_on = -1;
+    if (resource->owner == -1 && !process->abort_requested) {
+        resource->owner = index;
+        process->held[process->held_count++] = r;
+        result = 0;
+    }
+    pthread_mutex_unlock(&graph_mutex);
+    pthread_mutex_unlock(&resource->lock);
+    return result;
+}
+
+void release_resource(int r) {
+    Resource *resource = &sim_resources[r];
+    pthread_mutex_lock(&resource->lock);
+    pthread_mutex_lock(&graph_mutex);
+    resource->owner = -1;
+    pthread_mutex_unlock(&graph_mutex);
+    pthread_cond_broadcast(&resource->released);
+    pthread_mutex_unlock(&resource->lock);
+}
+
+void release_all_resources(SimProcess *process) {
+    while (process->held_count > 0) {
+        release_resource(process->held[--process->held_count]);
+    }
+}
+
+void *sim_process_function(void *arg) {
+    SimProcess *process = (SimProcess *)arg;
+    int wanted[MAX_HELD];
+    while (atomic_load(&sim_running)) {
+        // Pick distinct resources; the random order is what makes deadlocks possible
+        int count = 0;
+        while (count < resources_per_job) {
+            int r = rand_r(&process->seed) % num_sim_resources;
+            bool duplicate = false;
+            for (int i = 0; i < count; i++) {
+                duplicate |= wanted[i] == r;
+            }
+            if (!duplicate) {
+                wanted[count++] = r;
+            }
+        }
+
+        process->job_start = now_ns();
+        bool aborted = false;
+        for (int i = 0; i < count && !aborted; i++) {
+            aborted = acquire_resource(process, wanted[i]) != 0;
+        }
+        if (!aborted) {
+            usleep(work_us / 2 + rand_r(&process->seed) % (work_us + 1)); // Simulate resource usage
+            process->jobs_completed++;
+        } else if (process->abort_requested) {
+            process->jobs_aborted++;
+            process->abort_requested = false;
+        }
+        release_all_resources(process);
+    }
+    return NULL;
+}
+
+// Abort a victim: wake it from its wait so it rolls back and releases everything
+static void abort_process(int victim, int r) {
+    Resource *resource = &sim_resources[r];
+    pthread_mutex_lock(&resource->lock);
+    sim_processes[victim].abort_requested = true;
+    pthread_cond_broadcast(&resource->released);
+    pthread_mutex_unlock(&resource->lock);
+}
+
+// Find every cycle in the resource-allocation graph. Nodes 0..P-1 are
+// processes and P..P+R-1 are resources. A process waits on at most one
+// resource and a resource has at most one owner, so every node has at most
+// one outgoing edge and the depth-first search reduces to following chains,
+// visiting each node and edge once: O(V + E).
+void detect_deadlocks(int *state, int *next, int *victims, int *victim_resources) {
+    int P = num_sim_processes, V = num_sim_processes + num_sim_resources;
+    int victim_count = 0;
+    uint64_t detected_at;
+
+    pthread_mutex_lock(&graph_mutex);
+    detected_at = now_ns();
+    for (int p = 0; p < P; p++) {
+        next[p] = sim_processes[p].waiting_on >= 0 ? P + sim_processes[p].waiting_on : -1;
+    }
+    for (int r = 0; r < num_sim_resources; r++) {
+        next[P + r] = sim_resources[r].owner;
+    }
+    memset(state, 0, sizeof(int) * V); // 0 unvisited, otherwise 1 + the start node of the walk
+
+    for (int start = 0; start < P; start++) {
+        int node = start;
+        while (node != -1 && state[node] == 0) {
+            state[node] = start + 1;
+            node = next[node];
+        }
+        if (node == -1 || state[node] != start + 1) {
+            continue; // Chain ended or ran into an already explored walk
+        }
+
+        // node is on a new cycle: walk it once to measure it and pick the victim
+        int victim = -1, cycle_processes = 0;
+        uint64_t formed_at = 0, victim_cost = UINT64_MAX;
+        int cycle_node = node;
+        do {
+            if (cycle_node < P) {
+                SimProcess *process = &sim_processes[cycle_node];
+                uint64_t cost = process->blocked_since - process->job_start;
+                if (process->blocked_since > formed_at) {
+                    formed_at = process->blocked_since;
+                }
+                cycle_processes++;
+                if (cost < victim_cost) {
+                    victim_cost = cost;
+                    victim = cycle_node;
+                }
+            }
+            cycle_node = next[cycle_node];
+        } while (cycle_node != node);
+
+        uint64_t latency = detected_at - formed_at;
+        deadlocks_detected++;
+        total_detection_latency += latency;
+        if (latency > max_detection_latency) {
+            max_detection_latency = latency;
+        }
+        // Every process in the cycle was stuck from the moment it closed, and the victim's work is redone
+        time_lost_to_deadlocks += cycle_processes * latency + victim_cost;
+        victims[victim_count] = victim;
+        victim_resources[victim_count++] = sim_processes[victim].waiting_on;
+
+        if (verbose) {
+            printf("Deadlock detected:");
+            cycle_node = victim;
+            do {
+                printf(cycle_node < P ? " P%d ->" : " R%d ->", cycle_node < P ? cycle_node + 1 : cycle_node - P + 1);
+                cycle_node = next[cycle_node];
+            } while (cycle_node != victim);
+            printf(" P%d, aborting process %d\n", victim + 1, victim + 1);
+        }
+    }
+    pthread_mutex_unlock(&graph_mutex);
+
+    // A real deadlock cannot resolve itself, so the victims are still blocked
+    for (int i = 0; i < victim_count; i++) {
+        abort_process(victims[i], victim_resources[i]);
+    }
+}
+
+void *detector_function(void *arg) {
+    int V = num_sim_processes + num_sim_resources;
+    int *state = malloc(sizeof(int) * V);
+    int *next = malloc(sizeof(int) * V);
+    int *victims = malloc(sizeof(int) * num_sim_processes);
+    int *victim_resources = malloc(sizeof(int) * num_sim_processes);
+    while (atomic_load(&sim_running)) {
+        usleep(detect_interval_ms * 1000);
+        detect_deadlocks(state, next, victims, victim_resources);
+    }
+    free(state);
+    free(next);
+    free(victims);
+    free(victim_resources);
+    return NULL;
+}
+
+int run_detection(int argc, char *argv[]) {
+    int duration = 5;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--processes") == 0 && i + 1 < argc) {
+            num_sim_processes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--resources") == 0 && i + 1 < argc) {
+            num_sim_resources = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--hold") == 0 && i + 1 < argc) {
+            resources_per_job = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--work-us") == 0 && i + 1 < argc) {
+            work_us = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            detect_interval_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            duration = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = true;
+        } else {
+            printf("Usage: %s --detect [--processes N] [--resources R] [--hold K] [--work-us US]\n"
+                   "          [--interval MS] [--duration S] [--verbose]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (num_sim_processes < 1 || num_sim_resources < 1 || resources_per_job < 1 ||
+        resources_per_job > MAX_HELD || resources_per_job > num_sim_resources ||
+        work_us < 0 || detect_interval_ms < 1 || duration < 1) {
+        fprintf(stderr, "Invalid detection settings\n");
+        return 1;
+    }
+
+    sim_resources = malloc(sizeof(Resource) * num_sim_resources);
+    sim_processes = calloc(num_sim_processes, sizeof(SimProcess));
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_sim_processes);
+    for (int r = 0; r < num_sim_resources; r++) {
+        resource_init(&sim_resources[r]);
+    }
+    atomic_store(&sim_running, true);
+    for (int i = 0; i < num_sim_processes; i++) {
+        sim_processes[i].id = i + 1;
+        sim_processes[i].waiting_on = -1;
+        sim_processes[i].seed = (unsigned)time(NULL) ^ (i * 2654435761u);
+        pthread_create(&threads[i], NULL, sim_process_function, &sim_processes[i]);
+    }
+    pthread_t detector_thread;
+    pthread_create(&detector_thread, NULL, detector_function, NULL);
+
+    sleep(duration);
+    atomic_store(&sim_running, false);
+    for (int r = 0; r < num_sim_resources; r++) {
+        pthread_mutex_lock(&sim_resources[r].lock);
+        pthread_cond_broadcast(&sim_resources[r].released);
+        pthread_mutex_unlock(&sim_resources[r].lock);
+    }
+    for (int i = 0; i < num_sim_processes; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_join(detector_thread, NULL);
+
+    long completed = 0, aborted = 0;
+    for (int i = 0; i < num_sim_processes; i++) {
+        completed += sim_processes[i].jobs_completed;
+        aborted += sim_processes[i].jobs_aborted;
+    }
+    printf("Processes: %d, resources: %d, resources per job: %d, detector interval: %d ms\n",
+           num_sim_processes, num_sim_resources, resources_per_job, detect_interval_ms);
+    printf("Jobs completed: %ld (%.1f jobs/sec), jobs aborted: %ld\n",
+           completed, (double)completed / duration, aborted);
+    printf("Deadlocks detected: %ld, detection latency avg: %.2f ms, max: %.2f ms\n",
+           deadlocks_detected,
+           deadlocks_detected ? total_detection_latency / 1e6 / deadlocks_detected : 0.0,
+           max_detection_latency / 1e6);
+    printf("Process time lost to deadlocks: %.3f s (%.1f%% of total process time)\n",
+           time_lost_to_deadlocks / 1e9,
+           100.0 * time_lost_to_deadlocks / (1e9 * duration * num_sim_processes));
+
+    for (int r = 0; r < num_sim_resources; r++) {
+        resource_destroy(&sim_resources[r]);
+    }
+    free(sim_resources);
+    free(sim_processes);
+    free(threads);
+    return 0;
+}
+
+// Deadlock avoidance mode (Banker's algorithm).
+// Processes declare a maximum claim over a vector of resource types. Each
+// request is granted only if the state afterwards is still safe. The last safe
+// sequence is kept valid across grants and releases, so most checks only
+// replay a prefix of it instead of searching from scratch, and the
+// per-process comparisons run over whole rows with SIMD.
+typedef enum {
+    POLICY_BANKER,  // Grant only requests that leave the system in a safe state
+    POLICY_TIMEOUT  // Grant whenever units are free, terminate processes that wait too long
+} AvoidancePolicy;
+
+typedef struct {
+    int processes;
+    int types;
+    int stride;          // types rounded up to VECTOR_WIDTH, padding lanes stay zero
+    int32_t *total;
+    int32_t *available;
+    int32_t *maximum;    // processes x stride
+    int32_t *allocation;
+    int32_t *need;
+    int *safe_sequence;  // A safe sequence for the current state
+    int *new_sequence;
+    bool *finished;
+    int32_t *work;
+    long shortcut_hits;  // Checks answered because the requester could finish at once
+    long replay_hits;    // Checks answered by replaying part of the safe sequence
+    long full_searches;
+} Banker;
+
+bool reuse_safe_sequence = true;
+
+#define ROW(matrix, p) (b->matrix + (size_t)(p) * b->stride)
+
+// Returns true if every lane of a is <= the same lane of b
+static bool vector_leq(const int32_t *a, const int32_t *b, int n) {
+#if defined(__AVX2__)
+    for (int i = 0; i < n; i += 8) {
+        __m256i greater = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                             _mm256_loadu_si256((const __m256i *)(b + i)));
+        if (!_mm256_testz_si256(greater, greater)) {
+            return false;
+        }
+    }
+#elif defined(__SSE2__)
+    for (int i = 0; i < n; i += 4) {
+        __m128i greater = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *)(a + i)),
+                                          _mm_loadu_si128((const __m128i *)(b + i)));
+        if (_mm_movemask_epi8(greater)) {
+            return false;
+        }
+    }
+#else
+    for (int i = 0; i < n; i++) {
+        if (a[i] > b[i]) {
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+static void vector_add(int32_t *a, const int32_t *b, int n) {
+    for (int i = 0; i < n; i++) {
+        a[i] += b[i];
+    }
+}
+
+static void vector_sub(int32_t *a, const int32_t *b, int n) {
+    for (int i = 0; i < n; i++) {
+        a[i] -= b[i];
+    }
+}
+
+// Move process p to the front or back of the safe sequence
+static void move_in_sequence(Banker *b, int p, bool to_front) {
+    int *sequence = b->safe_sequence, i = 0;
+    while (sequence[i] != p) {
+        i++;
+    }
+    if (to_front) {
+        memmove(sequence + 1, sequence, sizeof(int) * i);
+        sequence[0] = p;
+    } else {
+        memmove(sequence + i, sequence + i + 1, sizeof(int) * (b->processes - i - 1));
+        sequence[b->processes - 1] = p;
+    }
+}
+
+int banker_init(Banker *b, int processes, int types) {
+    memset(b, 0, sizeof(Banker));
+    b->processes = processes;
+    b->types = types;
+    b->stride = (types + VECTOR_WIDTH - 1) / VECTOR_WIDTH * VECTOR_WIDTH;
+    size_t row = sizeof(int32_t) * b->stride, matrix = row * processes;
+    b->total = calloc(1, row);
+    b->available = calloc(1, row);
+    b->work = calloc(1, row);
+    b->maximum = calloc(1, matrix);
+    b->allocation = calloc(1, matrix);
+    b->need = calloc(1, matrix);
+    b->safe_sequence = malloc(sizeof(int) * processes);
+    b->new_sequence = malloc(sizeof(int) * processes);
+    b->finished = malloc(sizeof(bool) * processes);
+    if (!b->total || !b->available || !b->work || !b->maximum || !b->allocation ||
+        !b->need || !b->safe_sequence || !b->new_sequence || !b->finished) {
+        perror("Unable to allocate banker state");
+        return -1;
+    }
+    // Nothing is allocated yet and no claim exceeds the total, so any order is safe
+    for (int p = 0; p < processes; p++) {
+        b->safe_sequence[p] = p;
+    }
+    return 0;
+}
+
+void banker_destroy(Banker *b) {
+    free(b->total);
+    free(b->available);
+    free(b->work);
+    free(b->maximum);
+    free(b->allocation);
+    free(b->need);
+    free(b->safe_sequence);
+    free(b->new_sequence);
+    free(b->finished);
+}
+
+// Banker's safety check after a request from process p has been tentatively
+// applied. On success safe_sequence is updated to stay valid for the new state.
+//
+// Two facts keep this cheap. If p can now finish with what is available, it
+// can go first and everyone else keeps their old place. Otherwise the old
+// sequence only has less work available before p's position, and from p
+// onwards everything is unchanged, so only that prefix needs replaying.
+bool banker_is_safe(Banker *b, int p) {
+    int n = b->stride, prefix = 0;
+
+    if (reuse_safe_sequence) {
+        if (vector_leq(ROW(need, p), b->available, n)) {
+            move_in_sequence(b, p, true);
+            b->shortcut_hits++;
+            return true;
+        }
+        memcpy(b->work, b->available, sizeof(int32_t) * n);
+        memset(b->finished, 0, sizeof(bool) * b->processes);
+        for (; b->safe_sequence[prefix] != p; prefix++) {
+            int q = b->safe_sequence[prefix];
+            if (!vector_leq(ROW(need, q), b->work, n)) {
+                break;
+            }
+            vector_add(b->work, ROW(allocation, q), n);
+            b->finished[q] = true;
+            b->new_sequence[prefix] = q;
+        }
+        if (b->safe_sequence[prefix] == p) {
+            b->replay_hits++;
+            return true;
+        }
+    } else {
+        memcpy(b->work, b->available, sizeof(int32_t) * n);
+        memset(b->finished, 0, sizeof(bool) * b->processes);
+    }
+
+    // Full search, continuing from whatever prefix still replayed
+    b->full_searches++;
+    int count = prefix;
+    bool progress = true;
+    while (progress && count < b->processes) {
+        progress = false;
+        for (int q = 0; q < b->processes; q++) {
+            if (!b->finished[q] && vector_leq(ROW(need, q), b->work, n)) {
+                vector_add(b->work, ROW(allocation, q), n);
+                b->finished[q] = true;
+                b->new_sequence[count++] = q;
+                progress = true;
+            }
+        }
+    }
+    if (count < b->processes) {
+        return false;
+    }
+    memcpy(b->safe_sequence, b->new_sequence, sizeof(int) * b->processes);
+    return true;
 }
 
-int main() {
+// Try to grant a request. Returns 0 if granted, -1 if the units are not free
+// and -2 if granting would leave the system unsafe.
+int banker_request(Banker *b, int p, const int32_t *request) {
+    int n = b->stride;
+    if (!vector_leq(request, b->available, n)) {
+        return -1;
+    }
+    vector_sub(b->available, request, n);
+    vector_add(ROW(allocation, p), request, n);
+    vector_sub(ROW(need, p), request, n);
+    if (banker_is_safe(b, p)) {
+        return 0;
+    }
+    vector_add(b->available, request, n);
+    vector_sub(ROW(allocation, p), request, n);
+    vector_add(ROW(need, p), request, n);
+    return -2;
+}
+
+// Give back everything the process holds and start a new job with the same
+// claim. Moving p to the end keeps the safe sequence valid: everyone before it
+// now has more available, and at the end every unit is free again.
+void banker_release_all(Banker *b, int p) {
+    int n = b->stride;
+    vector_add(b->available, ROW(allocation, p), n);
+    memset(ROW(allocation, p), 0, sizeof(int32_t) * n);
+    memcpy(ROW(need, p), ROW(maximum, p), sizeof(int32_t) * n);
+    move_in_sequence(b, p, false);
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Avoidance benchmark settings
+int avoid_processes = 1000;
+int avoid_types = 16;
+int avoid_max_claim = 8;
+long avoid_steps = 200000;
+
+// Drive the simulated processes with either policy and print one result row.
+// Each step picks a random process: a blocked process retries its request, a
+// process whose claim is satisfied finishes its job, anything else asks for a
+// random part of its remaining need.
+void run_avoidance_policy(AvoidancePolicy policy) {
+    Banker bank, *b = &bank;
+    if (banker_init(b, avoid_processes, avoid_types) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    int n = b->stride;
+    unsigned seed = 12345;
+    int32_t *pending = calloc((size_t)avoid_processes * n, sizeof(int32_t)); // Blocked request per process
+    bool *blocked = calloc(avoid_processes, sizeof(bool));
+    int *timer = calloc(avoid_processes, sizeof(int));
+    uint32_t *latency = malloc(sizeof(uint32_t) * avoid_steps);
+
+    // Enough units for roughly half of the processes to hold their full claim at once
+    for (int r = 0; r < avoid_types; r++) {
+        b->total[r] = avoid_processes * avoid_max_claim / 4 + avoid_max_claim;
+        b->available[r] = b->total[r];
+    }
+    for (int p = 0; p < avoid_processes; p++) {
+        for (int r = 0; r < avoid_types; r++) {
+            ROW(maximum, p)[r] = rand_r(&seed) % (avoid_max_claim + 1);
+        }
+        banker_release_all(b, p);
+    }
+
+    long requests = 0, granted = 0, unsafe = 0, unavailable = 0, completed = 0, terminated = 0;
+    long samples = 0;
+    uint64_t start = now_ns();
+    for (long step = 0; step < avoid_steps; step++) {
+        int p = rand_r(&seed) % avoid_processes;
+        int32_t *request = pending + (size_t)p * n;
+        if (!blocked[p]) {
+            if (vector_leq(ROW(need, p), request, n)) { // request is all zero here, so need is empty
+                banker_release_all(b, p);
+                completed++;
+                continue;
+            }
+            for (int r = 0; r < avoid_types; r++) {
+                int32_t need = ROW(need, p)[r];
+                request[r] = need > 0 && rand_r(&seed) % 4 == 0 ? 1 + rand_r(&seed) % need : 0;
+            }
+        }
+
+        uint64_t decision_start = now_ns();
+        int result;
+        if (policy == POLICY_BANKER) {
+            result = banker_request(b, p, request);
+        } else if (vector_leq(request, b->available, n)) {
+            vector_sub(b->available, request, n);
+            vector_add(ROW(allocation, p), request, n);
+            vector_sub(ROW(need, p), request, n);
+            result = 0;
+        } else {
+            result = -1;
+        }
+        latency[samples++] = (uint32_t)(now_ns() - decision_start);
+        requests++;
+
+        if (result == 0) {
+            granted++;
+            blocked[p] = false;
+            timer[p] = 0;
+            memset(request, 0, sizeof(int32_t) * n);
+        } else {
+            result == -1 ? unavailable++ : unsafe++;
+            blocked[p] = true;
+            if (policy == POLICY_TIMEOUT && ++timer[p] >= TIMEOUT) {
+                // Same as process_function(): give up on the job after TIMEOUT tries
+                banker_release_all(b, p);
+                blocked[p] = false;
+                timer[p] = 0;
+                memset(request, 0, sizeof(int32_t) * n);
+                terminated++;
+            }
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    qsort(latency, samples, sizeof(uint32_t), compare_u32);
+    long checks = b->shortcut_hits + b->replay_hits + b->full_searches;
+    printf("%-8s %9ld %9ld %9ld %9ld %9ld %10ld %12.0f %8u %8u %7.1f%%\n",
+           policy == POLICY_BANKER ? "banker" : "timeout", requests, granted, unavailable, unsafe,
+           completed, terminated, requests / elapsed,
+           samples ? latency[samples / 2] : 0, samples ? latency[samples * 99 / 100] : 0,
+           checks ? 100.0 * (b->shortcut_hits + b->replay_hits) / checks : 0.0);
+
+    free(pending);
+    free(blocked);
+    free(timer);
+    free(latency);
+    banker_destroy(b);
+}
+
+int run_avoidance(int argc, char *argv[]) {
+    const char *policy = "both";
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--processes") == 0 && i + 1 < argc) {
+            avoid_processes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--types") == 0 && i + 1 < argc) {
+            avoid_types = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-claim") == 0 && i + 1 < argc) {
+            avoid_max_claim = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc) {
+            avoid_steps = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--policy") == 0 && i + 1 < argc) {
+            policy = argv[++i];
+        } else if (strcmp(argv[i], "--no-reuse") == 0) {
+            reuse_safe_sequence = false;
+        } else {
+            printf("Usage: %s --avoid [--processes N] [--types R] [--max-claim C] [--steps S]\n"
+                   "          [--policy banker|timeout|both] [--no-reuse]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (avoid_processes < 1 || avoid_types < 1 || avoid_max_claim < 1 || avoid_steps < 1) {
+        fprintf(stderr, "Invalid avoidance settings\n");
+        return 1;
+    }
+
+    printf("Processes: %d, resource types: %d, max claim per type: %d, steps: %ld, safe sequence reuse: %s\n",
+           avoid_processes, avoid_types, avoid_max_claim, avoid_steps, reuse_safe_sequence ? "on" : "off");
+    printf("%-8s %9s %9s %9s %9s %9s %10s %12s %8s %8s %8s\n", "policy", "requests", "granted",
+           "busy", "unsafe", "jobs", "terminated", "requests/sec", "p50 ns", "p99 ns", "reused");
+    if (strcmp(policy, "timeout") != 0) {
+        run_avoidance_policy(POLICY_BANKER);
+    }
+    if (strcmp(policy, "banker") != 0) {
+        run_avoidance_policy(POLICY_TIMEOUT);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--detect") == 0) {
+        return run_detection(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--avoid") == 0) {
+        return run_avoidance(argc, argv);
+    }
+
     pthread_t threads[NUM_PROCESSES];
-    pthread_mutex_init(&resource_mutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&shutdown_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    for (int i = 0; i < NUM_RESOURCES; i++) {
+        resource_init(&resources[i]);
+    }
 
     for (int i = 0; i < NUM_PROCESSES; i++) {
         processes[i].id = i + 1;
-        processes[i].resource_status = RESOURCE_AVAILABLE;
         processes[i].timer = 0;
+        processes[i].seed = (unsigned)time(NULL) ^ (i * 2654435761u);
         pthread_create(&threads[i], NULL, process_function, (void*)&processes[i]);
     }
 
     printf("Press Enter to quit...\n");
     getchar(); // Wait for user input to quit the program
-    quit_program(); // Call the function to set running to 0
+    quit_program(); // Stop the threads and wake any that are waiting
 
     for (int i = 0; i < NUM_PROCESSES; i++) {
         pthread_join(threads[i], NULL);
     }
 
-    pthread_mutex_destroy(&resource_mutex);
+    print_contention_profile();
+    for (int i = 0; i < NUM_RESOURCES; i++) {
+        resource_destroy(&resources[i]);
+    }
+    pthread_cond_destroy(&shutdown_cond);
     return 0;
 }
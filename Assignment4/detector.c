@@ -1,47 +1,1596 @@
 // Joseph Clauss
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-// Function to scan a single file for malware patterns
-void scan_file(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    char line[256];
+#define MAX_THREADS 256
+#define INITIAL_DEQUE_CAPACITY 256
+#define STEAL_ATTEMPTS 4 // Random victims a worker tries before backing off
+#define SCAN_BLOCK_SIZE (256 * 1024)
+#define DENSE_TABLE_LIMIT (256L * 1024 * 1024) // Largest DFA table before falling back to sparse edges
+#define BENCH_DATA_SIZE (32 << 20)
+#define DEFAULT_SIGNATURE "-rf *"
+#define MAX_CLASSES 257 // Every byte value plus the class for bytes in no signature
+#define MMAP_MIN_SIZE (64 * 1024) // Smaller files are cheaper to pread() than to map
+#define PREFILTER_MAX 8           // Most first bytes or byte pairs the SIMD prefilter compares against
+#define PREFILTER_WINDOW 64       // Bytes given to the automaton after each prefilter hit
+#define CACHE_MAGIC "DETCACHE"
+#define CACHE_FORMAT 1
+#define CACHE_COMPACT_MIN 4096 // Records a cache file needs before compaction is considered
+#define URING_BLOCK_SIZE (128 * 1024) // Size of each registered read buffer
+#define DEFAULT_QUEUE_DEPTH 64
+#define MAX_QUEUE_DEPTH 4096
 
-    if (file == NULL) {
+// An open directory shared by the work items for the entries inside it.
+// Files are opened relative to fd, so paths never have to be resolved again.
+typedef struct {
+    DIR *dir;
+    int fd;
+    atomic_int refs;
+    char *path; // Only used for printing
+} DirHandle;
+
+// One directory to list or one regular file to scan
+typedef struct {
+    DirHandle *parent; // NULL for the directories given on the command line
+    char *name;
+    bool is_dir;
+} WorkItem;
+
+// Per-worker double-ended queue. The owner pushes and pops at the bottom
+// (depth first, so few directories stay open) and idle workers steal from
+// the top, which holds the oldest and usually biggest pieces of work.
+typedef struct {
+    pthread_mutex_t lock;
+    WorkItem *items;
+    size_t head;     // Next item to steal
+    size_t tail;     // Next free slot at the bottom
+    size_t capacity; // Always a power of two
+} WorkDeque;
+
+// Scan cache file layout: a CacheHeader followed by fixed-size records.
+// Records are only ever appended; the newest record for an inode wins.
+typedef struct {
+    char magic[8];
+    uint32_t format;
+    uint32_t record_size;
+} CacheHeader;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t inode;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t db_version; // Hash of the signature database the verdict was made with
+    int32_t verdict;     // Matching signature, or -1 for a clean file
+    uint32_t reserved;
+} CacheRecord;
+
+// The cache file mapped read-only, with an open-addressing index from
+// (dev, inode) to the newest record. It is built before the workers start
+// and never changes during the scan, so lookups need no locking.
+typedef struct {
+    const char *path;
+    bool enabled;
+    uint64_t db_version;
+    void *map;
+    size_t map_size;
+    const CacheRecord *records;
+    size_t num_records;
+    uint32_t *slots; // Record index + 1, 0 for an empty slot
+    size_t num_slots; // Power of two
+    size_t live;      // Records reachable through the index
+    char *compacted;  // Header and records after compaction, replacing the mapping
+    bool reset;       // The file had an unknown format and is started over
+} ScanCache;
+
+// Per-worker results, padded so workers never share a cache line
+typedef struct {
+    _Alignas(64) long files;
+    long bytes;
+    long infected;
+    long cached; // Files skipped because the cache had a verdict
+    int index;
+    unsigned seed;
+    unsigned char *buffer; // SCAN_BLOCK_SIZE bytes for reading files
+    CacheRecord *new_records; // Verdicts to append to the cache when the scan ends
+    size_t num_new_records;
+    size_t new_records_capacity;
+} WorkerStats;
+
+typedef enum {
+    URING_OPEN,
+    URING_READ,
+    URING_CLOSE
+} UringStage;
+
+// A file being scanned by the io_uring engine. Each one owns a slot, whose
+// index is the user_data of its one request in flight and the registered
+// buffer its reads land in.
+typedef struct {
+    DirHandle *parent;
+    char *name;
+    struct stat st; // Only filled in (and used) when the scan cache is on
+    int fd;
+    off_t offset;
+    uint32_t state;
+    int match_id;
+    bool complete;
+    UringStage stage;
+} UringFile;
+
+// One io_uring instance per worker, driven with raw system calls
+typedef struct {
+    int fd;
+    int depth;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    unsigned to_submit;  // Queued requests the kernel has not taken yet
+    bool fixed_buffers;  // False if registering the buffers failed; plain reads are used then
+    unsigned char *buffers; // depth blocks of URING_BLOCK_SIZE
+    UringFile *files;
+    int *free_slots;
+    int num_free;
+} Uring;
+
+// Signature database compiled into an Aho-Corasick automaton.
+// Bytes that appear in no signature share class 0, every other byte gets its
+// own class, so tables only need one column per distinct signature byte.
+// When the full DFA fits in DENSE_TABLE_LIMIT it is used directly: every
+// entry is the premultiplied row of the next state shifted left once, with the
+// low bit set when that state completes a signature. Larger databases keep the
+// trie as sparse edge lists plus failure links instead.
+typedef struct {
+    int num_signatures;
+    char **names;          // Signature text as written in the database, for reports
+    unsigned char **bytes; // Decoded signature bytes
+    int *lengths;
+
+    int num_states;
+    int num_classes;
+    uint16_t byte_class[256]; // 0 for bytes in no signature, up to 256 other classes
+    int32_t *match;        // Signature completed in each state, -1 if none
+
+    uint32_t *table;       // Dense DFA, NULL when the sparse form is used
+
+    int32_t *fail;         // Sparse form: failure link of each state
+    int32_t *edge_start;   // Edges of state s are edge_start[s] .. edge_start[s + 1] - 1
+    uint16_t *edge_class;
+    int32_t *edge_target;
+    int32_t root_next[MAX_CLASSES]; // Root transitions by class
+
+    // While the automaton is in the root state, only positions where some
+    // signature could start need to be fed through it. When the database has
+    // few distinct first bytes (or first two bytes), those are found with
+    // vector compares instead. prefilter_count is 0 when there are too many.
+    int prefilter_count;
+    bool prefilter_pairs; // Compare the first two bytes rather than just the first
+    unsigned char prefilter_first[PREFILTER_MAX];
+    unsigned char prefilter_second[PREFILTER_MAX];
+} SignatureMatcher;
+
+SignatureMatcher matcher;
+bool use_mmap = true;
+bool use_prefilter = true;
+bool evict_after_scan = false;
+ScanCache cache;
+bool use_uring = false;
+int queue_depth = DEFAULT_QUEUE_DEPTH;
+Uring rings[MAX_THREADS];
+
+// Decode one database line: \xNN and \\ escapes, everything else literal
+static int decode_signature(const char *text, unsigned char *out) {
+    int length = 0;
+    for (const char *p = text; *p; p++) {
+        if (p[0] == '\\' && p[1] == 'x' && isxdigit((unsigned char)p[2]) && isxdigit((unsigned char)p[3])) {
+            char hex[3] = {p[2], p[3], 0};
+            out[length++] = (unsigned char)strtol(hex, NULL, 16);
+            p += 3;
+        } else if (p[0] == '\\' && p[1] == '\\') {
+            out[length++] = '\\';
+            p++;
+        } else {
+            out[length++] = (unsigned char)*p;
+        }
+    }
+    return length;
+}
+
+static void add_signature(SignatureMatcher *m, const char *text) {
+    unsigned char *bytes = malloc(strlen(text) + 1);
+    int length = decode_signature(text, bytes);
+    if (length == 0) {
+        free(bytes);
         return;
     }
+    int n = m->num_signatures++;
+    m->names = realloc(m->names, sizeof(char *) * m->num_signatures);
+    m->bytes = realloc(m->bytes, sizeof(unsigned char *) * m->num_signatures);
+    m->lengths = realloc(m->lengths, sizeof(int) * m->num_signatures);
+    m->names[n] = strdup(text);
+    m->bytes[n] = bytes;
+    m->lengths[n] = length;
+}
 
-    while (fgets(line, sizeof(line), file)) {
-        if (strstr(line, "-rf *")) {
-            printf("Warning: file %s is infected!\n", filename);
+// Load one signature per line, skipping blank lines and lines starting with #
+int load_signatures(SignatureMatcher *m, const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        perror("Unable to open signature database");
+        return -1;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, file)) != -1) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] != '\0' && line[0] != '#') {
+            add_signature(m, line);
+        }
+    }
+    free(line);
+    fclose(file);
+    return 0;
+}
+
+// Child of trie state s on class k while building, -1 if there is none
+static int trie_child(const SignatureMatcher *m, const int32_t *first_child, const int32_t *next_sibling,
+                      const uint16_t *class_in, int s, uint16_t k) {
+    if (s == 0) {
+        return m->root_next[k] != 0 ? m->root_next[k] : -1;
+    }
+    for (int child = first_child[s]; child != -1; child = next_sibling[child]) {
+        if (class_in[child] == k) {
+            return child;
+        }
+    }
+    return -1;
+}
+
+// Compile the loaded signatures into the automaton
+// Collect the distinct first byte pairs of the database, or just the first
+// bytes when pairs are too many or some signature is a single byte
+static void setup_prefilter(SignatureMatcher *m) {
+    for (int pairs = 1; pairs >= 0; pairs--) {
+        int count = 0;
+        for (int i = 0; i < m->num_signatures && count <= PREFILTER_MAX; i++) {
+            if (pairs && m->lengths[i] < 2) {
+                count = PREFILTER_MAX + 1;
+                break;
+            }
+            unsigned char first = m->bytes[i][0], second = pairs ? m->bytes[i][1] : 0;
+            int k = 0;
+            while (k < count && (m->prefilter_first[k] != first || m->prefilter_second[k] != second)) {
+                k++;
+            }
+            if (k == count && count++ < PREFILTER_MAX) {
+                m->prefilter_first[k] = first;
+                m->prefilter_second[k] = second;
+            }
+        }
+        if (count <= PREFILTER_MAX) {
+            m->prefilter_count = count;
+            m->prefilter_pairs = pairs;
+            return;
+        }
+    }
+    m->prefilter_count = 0;
+}
+
+int compile_signatures(SignatureMatcher *m) {
+    // Byte classes
+    memset(m->byte_class, 0, sizeof(m->byte_class));
+    m->num_classes = 1;
+    for (int i = 0; i < m->num_signatures; i++) {
+        for (int j = 0; j < m->lengths[i]; j++) {
+            if (m->byte_class[m->bytes[i][j]] == 0) {
+                m->byte_class[m->bytes[i][j]] = m->num_classes++;
+            }
+        }
+    }
+
+    // Trie with children as sibling lists while building
+    long max_states = 1;
+    for (int i = 0; i < m->num_signatures; i++) {
+        max_states += m->lengths[i];
+    }
+    int32_t *first_child = malloc(sizeof(int32_t) * max_states);
+    int32_t *next_sibling = malloc(sizeof(int32_t) * max_states);
+    uint16_t *class_in = malloc(sizeof(uint16_t) * max_states);
+    m->match = malloc(sizeof(int32_t) * max_states);
+    m->fail = malloc(sizeof(int32_t) * max_states);
+    int32_t *order = malloc(sizeof(int32_t) * max_states);
+    if (!first_child || !next_sibling || !class_in || !m->match || !m->fail || !order) {
+        perror("Unable to allocate signature automaton");
+        return -1;
+    }
+    first_child[0] = -1;
+    m->match[0] = -1;
+    int states = 1;
+    for (int i = 0; i < m->num_signatures; i++) {
+        int s = 0;
+        for (int j = 0; j < m->lengths[i]; j++) {
+            uint16_t k = m->byte_class[m->bytes[i][j]];
+            int child = first_child[s];
+            while (child != -1 && class_in[child] != k) {
+                child = next_sibling[child];
+            }
+            if (child == -1) {
+                child = states++;
+                first_child[child] = -1;
+                class_in[child] = k;
+                m->match[child] = -1;
+                next_sibling[child] = first_child[s];
+                first_child[s] = child;
+            }
+            s = child;
+        }
+        if (m->match[s] == -1) {
+            m->match[s] = i;
+        }
+    }
+    m->num_states = states;
+
+    // Breadth-first order, failure links, and outputs inherited along failure links
+    for (int k = 0; k < MAX_CLASSES; k++) {
+        m->root_next[k] = 0;
+    }
+    for (int child = first_child[0]; child != -1; child = next_sibling[child]) {
+        m->root_next[class_in[child]] = child;
+    }
+    int head = 0, tail = 0;
+    order[tail++] = 0;
+    m->fail[0] = 0;
+    while (head < tail) {
+        int s = order[head++];
+        for (int child = first_child[s]; child != -1; child = next_sibling[child]) {
+            uint16_t k = class_in[child];
+            int f = 0;
+            if (s != 0) {
+                // Longest proper suffix of child that is also in the trie
+                f = m->fail[s];
+                int target;
+                while ((target = trie_child(m, first_child, next_sibling, class_in, f, k)) == -1 && f != 0) {
+                    f = m->fail[f];
+                }
+                f = target == -1 ? 0 : target;
+            }
+            m->fail[child] = f;
+            if (m->match[child] == -1) {
+                m->match[child] = m->match[f];
+            }
+            order[tail++] = child;
+        }
+    }
+
+    long entries = (long)states * m->num_classes;
+    if (entries * (long)sizeof(uint32_t) <= DENSE_TABLE_LIMIT) {
+        // Dense DFA: rows are numbered in breadth-first order so the shallow states that
+        // random input keeps returning to sit together at the front of the table
+        m->table = malloc(sizeof(uint32_t) * entries);
+        int32_t *rank = malloc(sizeof(int32_t) * states);
+        int32_t *match = malloc(sizeof(int32_t) * states);
+        if (m->table == NULL || rank == NULL || match == NULL) {
+            perror("Unable to allocate signature table");
+            return -1;
+        }
+        for (int i = 0; i < states; i++) {
+            rank[order[i]] = i;
+        }
+        for (int i = 0; i < states; i++) {
+            int s = order[i];
+            uint32_t *row = m->table + (long)i * m->num_classes;
+            // Each row starts as a copy of its failure state's row, which is already built
+            if (s == 0) {
+                memset(row, 0, sizeof(uint32_t) * m->num_classes);
+            } else {
+                memcpy(row, m->table + (long)rank[m->fail[s]] * m->num_classes, sizeof(uint32_t) * m->num_classes);
+            }
+            for (int child = first_child[s]; child != -1; child = next_sibling[child]) {
+                row[class_in[child]] = ((uint32_t)rank[child] * m->num_classes) << 1 | (m->match[child] >= 0);
+            }
+            match[i] = m->match[s];
+        }
+        free(m->match);
+        m->match = match;
+        free(rank);
+        free(m->fail);
+        m->fail = NULL;
+    } else {
+        // Sparse form: edges of every state packed together
+        m->edge_start = malloc(sizeof(int32_t) * (states + 1));
+        m->edge_class = malloc(sizeof(uint16_t) * states);
+        m->edge_target = malloc(sizeof(int32_t) * states);
+        int edges = 0;
+        for (int s = 0; s < states; s++) {
+            m->edge_start[s] = edges;
+            for (int child = first_child[s]; child != -1; child = next_sibling[child]) {
+                m->edge_class[edges] = class_in[child];
+                m->edge_target[edges++] = child;
+            }
+        }
+        m->edge_start[states] = edges;
+    }
+
+    free(first_child);
+    free(next_sibling);
+    free(class_in);
+    free(order);
+    setup_prefilter(m);
+    return 0;
+}
+
+void free_signatures(SignatureMatcher *m) {
+    for (int i = 0; i < m->num_signatures; i++) {
+        free(m->names[i]);
+        free(m->bytes[i]);
+    }
+    free(m->names);
+    free(m->bytes);
+    free(m->lengths);
+    free(m->match);
+    free(m->table);
+    free(m->fail);
+    free(m->edge_start);
+    free(m->edge_class);
+    free(m->edge_target);
+    memset(m, 0, sizeof(SignatureMatcher));
+}
+
+// Bytes used by the compiled automaton
+long matcher_memory(const SignatureMatcher *m) {
+    long bytes = sizeof(int32_t) * (long)m->num_states;
+    if (m->table != NULL) {
+        return bytes + sizeof(uint32_t) * (long)m->num_states * m->num_classes;
+    }
+    return bytes + (sizeof(int32_t) * 3 + sizeof(uint16_t)) * (long)m->num_states;
+}
+
+// Feed a block through the automaton. *state carries over between blocks, so
+// matches that straddle two blocks are still found. Returns the number of
+// bytes consumed, stopping right after the first match, whose signature is
+// stored in *match_id (-1 if the whole block had no match).
+size_t matcher_scan(const SignatureMatcher *m, uint32_t *state, const unsigned char *data, size_t length,
+                    int *match_id) {
+    const uint16_t *byte_class = m->byte_class;
+    *match_id = -1;
+    if (m->table != NULL) {
+        const uint32_t *table = m->table;
+        uint32_t row = *state * m->num_classes;
+        for (size_t i = 0; i < length; i++) {
+            uint32_t entry = table[row + byte_class[data[i]]];
+            row = entry >> 1;
+            if (entry & 1) {
+                *state = row / m->num_classes;
+                *match_id = m->match[*state];
+                return i + 1;
+            }
+        }
+        *state = row / m->num_classes;
+        return length;
+    }
+
+    int32_t s = *state;
+    for (size_t i = 0; i < length; i++) {
+        uint16_t k = byte_class[data[i]];
+        if (k == 0) {
+            s = 0; // Byte appears in no signature
+            continue;
+        }
+        for (;;) {
+            if (s == 0) {
+                s = m->root_next[k];
+                break;
+            }
+            int32_t next = -1;
+            for (int32_t e = m->edge_start[s]; e < m->edge_start[s + 1]; e++) {
+                if (m->edge_class[e] == k) {
+                    next = m->edge_target[e];
+                    break;
+                }
+            }
+            if (next != -1) {
+                s = next;
+                break;
+            }
+            s = m->fail[s];
+        }
+        if (m->match[s] >= 0) {
+            *state = s;
+            *match_id = m->match[s];
+            return i + 1;
+        }
+    }
+    *state = s;
+    return length;
+}
+
+// Return the offset of the first position in data where a signature could
+// start. In pair mode the last byte cannot be checked without the byte after
+// it, so it is always reported as a candidate.
+static size_t prefilter_skip(const SignatureMatcher *m, const unsigned char *data, size_t length) {
+    size_t lookahead = m->prefilter_pairs ? 1 : 0;
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 32 + lookahead <= length; i += 32) {
+        __m256i first = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i second = _mm256_loadu_si256((const __m256i *)(data + i + lookahead));
+        __m256i hits = _mm256_setzero_si256();
+        for (int k = 0; k < m->prefilter_count; k++) {
+            __m256i hit = _mm256_cmpeq_epi8(first, _mm256_set1_epi8((char)m->prefilter_first[k]));
+            if (m->prefilter_pairs) {
+                hit = _mm256_and_si256(hit, _mm256_cmpeq_epi8(second, _mm256_set1_epi8((char)m->prefilter_second[k])));
+            }
+            hits = _mm256_or_si256(hits, hit);
+        }
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 16 + lookahead <= length; i += 16) {
+        __m128i first = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i second = _mm_loadu_si128((const __m128i *)(data + i + lookahead));
+        __m128i hits = _mm_setzero_si128();
+        for (int k = 0; k < m->prefilter_count; k++) {
+            __m128i hit = _mm_cmpeq_epi8(first, _mm_set1_epi8((char)m->prefilter_first[k]));
+            if (m->prefilter_pairs) {
+                hit = _mm_and_si128(hit, _mm_cmpeq_epi8(second, _mm_set1_epi8((char)m->prefilter_second[k])));
+            }
+            hits = _mm_or_si128(hits, hit);
+        }
+        unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i + lookahead < length; i++) {
+        for (int k = 0; k < m->prefilter_count; k++) {
+            if (data[i] == m->prefilter_first[k] && (!m->prefilter_pairs || data[i + 1] == m->prefilter_second[k])) {
+                return i;
+            }
+        }
+    }
+    return i;
+}
+
+// Scan one buffer, skipping ahead with the prefilter whenever the automaton
+// is back in the root state. Works like matcher_scan(): returns the bytes
+// consumed and stores the first matching signature (or -1) in *match_id.
+size_t scan_buffer(const SignatureMatcher *m, uint32_t *state, const unsigned char *data, size_t length,
+                   int *match_id) {
+    bool filter = use_prefilter && m->prefilter_count > 0;
+    size_t pos = 0;
+    *match_id = -1;
+    while (pos < length) {
+        if (filter && *state == 0) {
+            pos += prefilter_skip(m, data + pos, length - pos);
+            if (pos == length) {
+                break;
+            }
+        }
+        size_t window = filter && length - pos > PREFILTER_WINDOW ? PREFILTER_WINDOW : length - pos;
+        pos += matcher_scan(m, state, data + pos, window, match_id);
+        if (*match_id >= 0) {
             break;
         }
     }
+    return pos;
+}
 
-    fclose(file);
+// FNV-1a hash of the decoded signatures, so cached verdicts are dropped
+// whenever the database changes
+uint64_t signature_db_version(const SignatureMatcher *m) {
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < m->num_signatures; i++) {
+        for (int j = 0; j <= m->lengths[i]; j++) {
+            // The length goes in after each signature so "ab","c" differs from "a","bc"
+            unsigned char byte = j < m->lengths[i] ? m->bytes[i][j] : (unsigned char)m->lengths[i];
+            hash = (hash ^ byte) * 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+static size_t cache_slot(const ScanCache *c, uint64_t dev, uint64_t inode) {
+    uint64_t hash = (inode * 0x9e3779b97f4a7c15ull) ^ (dev * 0xc2b2ae3d27d4eb4full);
+    return (hash ^ (hash >> 29)) & (c->num_slots - 1);
+}
+
+// Map the cache file and index its records. Records made with another
+// signature database are dead and left out of the index.
+static int cache_load(ScanCache *c) {
+    int fd = open(c->path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0; // No cache yet
+    }
+    if (st.st_size < (off_t)sizeof(CacheHeader)) {
+        close(fd);
+        return 0;
+    }
+    c->map_size = st.st_size;
+    c->map = mmap(NULL, c->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (c->map == MAP_FAILED) {
+        c->map = NULL;
+        perror("Unable to map scan cache");
+        return -1;
+    }
+    const CacheHeader *header = c->map;
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 || header->format != CACHE_FORMAT ||
+        header->record_size != sizeof(CacheRecord)) {
+        fprintf(stderr, "Ignoring scan cache %s: unknown format\n", c->path);
+        munmap(c->map, c->map_size);
+        c->map = NULL;
+        c->reset = true;
+        return 0;
+    }
+    c->records = (const CacheRecord *)(header + 1);
+    // A partly written record at the end (from a crash) is ignored
+    c->num_records = (c->map_size - sizeof(CacheHeader)) / sizeof(CacheRecord);
+
+    c->num_slots = 16;
+    while (c->num_slots < c->num_records * 2) {
+        c->num_slots *= 2;
+    }
+    c->slots = calloc(c->num_slots, sizeof(uint32_t));
+    for (size_t i = 0; i < c->num_records; i++) {
+        const CacheRecord *record = &c->records[i];
+        if (record->db_version != c->db_version) {
+            continue;
+        }
+        size_t slot = cache_slot(c, record->dev, record->inode);
+        while (c->slots[slot] != 0) {
+            const CacheRecord *old = &c->records[c->slots[slot] - 1];
+            if (old->dev == record->dev && old->inode == record->inode) {
+                break;
+            }
+            slot = (slot + 1) & (c->num_slots - 1);
+        }
+        if (c->slots[slot] == 0) {
+            c->live++;
+        }
+        c->slots[slot] = i + 1;
+    }
+    return 0;
+}
+
+// Rewrite the cache with only its live records. The new file is written
+// next to the old one and renamed over it, so a crash leaves one or the other.
+static int cache_compact(ScanCache *c) {
+    size_t length = strlen(c->path);
+    char *temp = malloc(length + 5);
+    memcpy(temp, c->path, length);
+    memcpy(temp + length, ".tmp", 5);
+
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Unable to compact scan cache");
+        free(temp);
+        return -1;
+    }
+    size_t size = sizeof(CacheHeader) + c->live * sizeof(CacheRecord);
+    char *out = malloc(size);
+    memcpy(out, c->map, sizeof(CacheHeader));
+    CacheRecord *records = (CacheRecord *)(out + sizeof(CacheHeader));
+    size_t count = 0;
+    for (size_t slot = 0; slot < c->num_slots; slot++) {
+        if (c->slots[slot] != 0) {
+            records[count] = c->records[c->slots[slot] - 1];
+            c->slots[slot] = ++count;
+        }
+    }
+    bool ok = write(fd, out, size) == (ssize_t)size && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(temp, c->path) != 0) {
+        perror("Unable to compact scan cache");
+        unlink(temp);
+        free(out);
+        free(temp);
+        return -1;
+    }
+    free(temp);
+
+    // Keep using the compacted copy in memory; it matches the new file
+    munmap(c->map, c->map_size);
+    c->map = NULL;
+    c->map_size = 0;
+    c->records = records;
+    c->num_records = count;
+    c->compacted = out;
+    return 0;
+}
+
+int cache_open(ScanCache *c, const char *path, uint64_t db_version) {
+    memset(c, 0, sizeof(ScanCache));
+    c->path = path;
+    c->enabled = true;
+    c->db_version = db_version;
+    if (cache_load(c) != 0) {
+        return -1;
+    }
+    if (c->num_records >= CACHE_COMPACT_MIN && c->num_records > 2 * c->live) {
+        printf("Compacting scan cache: %zu records, %zu live\n", c->num_records, c->live);
+        cache_compact(c);
+    }
+    return 0;
+}
+
+// Find the cached verdict for a file, if it has not changed since it was scanned
+const CacheRecord *cache_lookup(const ScanCache *c, const struct stat *st) {
+    if (c->slots == NULL) {
+        return NULL;
+    }
+    size_t slot = cache_slot(c, st->st_dev, st->st_ino);
+    while (c->slots[slot] != 0) {
+        const CacheRecord *record = &c->records[c->slots[slot] - 1];
+        if (record->dev == (uint64_t)st->st_dev && record->inode == (uint64_t)st->st_ino) {
+            uint64_t mtime_ns = (uint64_t)st->st_mtim.tv_sec * 1000000000ull + st->st_mtim.tv_nsec;
+            return record->size == (uint64_t)st->st_size && record->mtime_ns == mtime_ns ? record : NULL;
+        }
+        slot = (slot + 1) & (c->num_slots - 1);
+    }
+    return NULL;
+}
+
+// Remember a verdict in the worker's list of records to append
+void cache_remember(WorkerStats *stats, const struct stat *st, int verdict) {
+    if (stats->num_new_records == stats->new_records_capacity) {
+        stats->new_records_capacity = stats->new_records_capacity ? stats->new_records_capacity * 2 : 256;
+        stats->new_records = realloc(stats->new_records, sizeof(CacheRecord) * stats->new_records_capacity);
+    }
+    CacheRecord *record = &stats->new_records[stats->num_new_records++];
+    record->dev = st->st_dev;
+    record->inode = st->st_ino;
+    record->size = st->st_size;
+    record->mtime_ns = (uint64_t)st->st_mtim.tv_sec * 1000000000ull + st->st_mtim.tv_nsec;
+    record->db_version = cache.db_version;
+    record->verdict = verdict;
+    record->reserved = 0;
+}
+
+// Append the new verdicts of every worker in one write, creating the file if needed
+int cache_append(ScanCache *c, WorkerStats *stats, int workers) {
+    size_t count = 0;
+    for (int i = 0; i < workers; i++) {
+        count += stats[i].num_new_records;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    int fd = open(c->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Unable to update scan cache");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    size_t size = count * sizeof(CacheRecord);
+    size_t offset = 0;
+    bool fresh = c->reset || st.st_size < (off_t)sizeof(CacheHeader);
+    if (fresh) {
+        // New or unreadable cache: start over with a fresh header
+        if (ftruncate(fd, 0) != 0) {
+            perror("Unable to update scan cache");
+            close(fd);
+            return -1;
+        }
+        offset = sizeof(CacheHeader);
+    } else if ((st.st_size - sizeof(CacheHeader)) % sizeof(CacheRecord) != 0) {
+        // Pad out a record torn by an earlier crash so later records stay aligned.
+        // The zeroed record never matches a real database version.
+        offset = sizeof(CacheRecord) - (st.st_size - sizeof(CacheHeader)) % sizeof(CacheRecord);
+    }
+    char *out = calloc(1, offset + size);
+    if (fresh) {
+        CacheHeader *header = (CacheHeader *)out;
+        memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+        header->format = CACHE_FORMAT;
+        header->record_size = sizeof(CacheRecord);
+    }
+    char *next = out + offset;
+    for (int i = 0; i < workers; i++) {
+        memcpy(next, stats[i].new_records, stats[i].num_new_records * sizeof(CacheRecord));
+        next += stats[i].num_new_records * sizeof(CacheRecord);
+    }
+    int result = write(fd, out, offset + size) == (ssize_t)(offset + size) ? 0 : -1;
+    if (result != 0) {
+        perror("Unable to update scan cache");
+    }
+    free(out);
+    close(fd);
+    return result;
 }
 
-// Function to scan all files in a directory
-void scan_directory(const char *dirname) {
-    DIR *dir = opendir(dirname);
+void cache_close(ScanCache *c) {
+    if (c->map != NULL) {
+        munmap(c->map, c->map_size);
+    }
+    free(c->compacted);
+    free(c->slots);
+    memset(c, 0, sizeof(ScanCache));
+}
+
+WorkDeque deques[MAX_THREADS];
+int num_workers = 1;
+atomic_long pending_items; // Items queued or being processed, 0 means the scan is done
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void deque_init(WorkDeque *deque) {
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->items = malloc(sizeof(WorkItem) * INITIAL_DEQUE_CAPACITY);
+    deque->head = deque->tail = 0;
+    deque->capacity = INITIAL_DEQUE_CAPACITY;
+}
+
+void deque_destroy(WorkDeque *deque) {
+    pthread_mutex_destroy(&deque->lock);
+    free(deque->items);
+}
+
+void deque_push(WorkDeque *deque, WorkItem item) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail - deque->head == deque->capacity) {
+        WorkItem *items = malloc(sizeof(WorkItem) * deque->capacity * 2);
+        for (size_t i = deque->head; i < deque->tail; i++) {
+            items[i & (deque->capacity * 2 - 1)] = deque->items[i & (deque->capacity - 1)];
+        }
+        free(deque->items);
+        deque->items = items;
+        deque->capacity *= 2;
+    }
+    deque->items[deque->tail++ & (deque->capacity - 1)] = item;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+bool deque_pop(WorkDeque *deque, WorkItem *item) {
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        *item = deque->items[--deque->tail & (deque->capacity - 1)];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+bool deque_steal(WorkDeque *deque, WorkItem *item) {
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        *item = deque->items[deque->head++ & (deque->capacity - 1)];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static void dir_release(DirHandle *handle) {
+    if (handle != NULL && atomic_fetch_sub(&handle->refs, 1) == 1) {
+        closedir(handle->dir);
+        free(handle->path);
+        free(handle);
+    }
+}
+
+// Queue a new item on the worker's own deque
+static void submit(WorkerStats *stats, DirHandle *parent, const char *name, bool is_dir) {
+    WorkItem item = {parent, strdup(name), is_dir};
+    if (parent != NULL) {
+        atomic_fetch_add(&parent->refs, 1);
+    }
+    atomic_fetch_add(&pending_items, 1);
+    deque_push(&deques[stats->index], item);
+}
+
+static char *join_path(const DirHandle *parent, const char *name) {
+    if (parent == NULL) {
+        return strdup(name);
+    }
+    size_t length = strlen(parent->path) + strlen(name) + 2;
+    char *path = malloc(length);
+    snprintf(path, length, "%s/%s", parent->path, name);
+    return path;
+}
+
+// Reuse the cached verdict of a file that is unchanged since the last scan.
+// Returns true when the file needs no scan; otherwise *st holds its metadata
+// (when *have_stat is set) for recording the new verdict.
+static bool check_cache(WorkerStats *stats, DirHandle *parent, const char *name, struct stat *st, bool *have_stat) {
+    *have_stat = cache.enabled && fstatat(parent ? parent->fd : AT_FDCWD, name, st, AT_SYMLINK_NOFOLLOW) == 0;
+    const CacheRecord *record = *have_stat ? cache_lookup(&cache, st) : NULL;
+    // A verdict naming no signature comes from a corrupt cache file: scan again
+    if (record == NULL || record->verdict < -1 || record->verdict >= matcher.num_signatures) {
+        return false;
+    }
+    stats->files++;
+    stats->cached++;
+    if (record->verdict >= 0) {
+        char *path = join_path(parent, name);
+        printf("Warning: file %s is infected! (signature: %s)\n", path, matcher.names[record->verdict]);
+        free(path);
+        stats->infected++;
+    }
+    return true;
+}
+
+// Report the result of scanning one file and remember it in the scan cache
+static void finish_file(WorkerStats *stats, DirHandle *parent, const char *name, const struct stat *st,
+                        int match_id, bool complete) {
+    if (match_id >= 0) {
+        char *path = join_path(parent, name);
+        printf("Warning: file %s is infected! (signature: %s)\n", path, matcher.names[match_id]);
+        free(path);
+        stats->infected++;
+    }
+    if (cache.enabled && complete && S_ISREG(st->st_mode)) {
+        cache_remember(stats, st, match_id);
+    }
+}
+
+// Function to scan a single file for malware patterns. Large regular files
+// are mapped and scanned in place; small or special files are read with
+// pread() into the worker's buffer, carrying the automaton state across blocks.
+// With a scan cache, files whose size and mtime are unchanged are not opened.
+void scan_file(WorkerStats *stats, DirHandle *parent, const char *name) {
+    struct stat st;
+    bool have_stat;
+    if (check_cache(stats, parent, name, &st, &have_stat)) {
+        return;
+    }
+
+    int fd = openat(parent ? parent->fd : AT_FDCWD, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return;
+    }
+
+    stats->files++;
+    uint32_t state = 0;
+    int match_id = -1;
+    bool mapped = false;
+    bool complete = true; // False when a read error cut the scan short
+    if (use_mmap && S_ISREG(st.st_mode) && st.st_size >= MMAP_MIN_SIZE) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            mapped = true;
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            stats->bytes += scan_buffer(&matcher, &state, data, st.st_size, &match_id);
+            munmap(data, st.st_size);
+        }
+    }
+    if (!mapped) {
+        ssize_t length;
+        off_t offset = 0;
+        while ((length = pread(fd, stats->buffer, SCAN_BLOCK_SIZE, offset)) > 0) {
+            offset += length;
+            stats->bytes += scan_buffer(&matcher, &state, stats->buffer, length, &match_id);
+            if (match_id >= 0) {
+                break;
+            }
+        }
+        complete = length >= 0;
+    }
+    finish_file(stats, parent, name, &st, match_id, complete);
+    if (evict_after_scan) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED); // Leave the page cache cold for the next run
+    }
+
+    close(fd);
+}
+
+// Function to queue every entry of a directory for scanning
+void scan_directory(WorkerStats *stats, DirHandle *parent, const char *name) {
+    int fd = openat(parent ? parent->fd : AT_FDCWD, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    DIR *dir = fdopendir(fd);
     struct dirent *entry;
 
     if (dir == NULL) {
+        close(fd);
         return;
     }
 
+    DirHandle *handle = malloc(sizeof(DirHandle));
+    handle->dir = dir;
+    handle->fd = fd;
+    handle->path = join_path(parent, name);
+    atomic_init(&handle->refs, 1); // Held by this function until the listing is queued
+
     while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG) { // Regular file
-            scan_file(entry->d_name);
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) { // Some file systems do not fill in d_type
+            struct stat st;
+            if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) {
+            submit(stats, handle, entry->d_name, true);
+        } else if (type == DT_REG) { // Regular file
+            submit(stats, handle, entry->d_name, false);
+        }
+    }
+
+    dir_release(handle);
+}
+
+// Take work from our own deque first, then try to steal from random workers
+static bool find_work(WorkerStats *stats, WorkItem *item) {
+    if (deque_pop(&deques[stats->index], item)) {
+        return true;
+    }
+    for (int attempt = 0; attempt < STEAL_ATTEMPTS * num_workers; attempt++) {
+        int victim = rand_r(&stats->seed) % num_workers;
+        if (victim != stats->index && deque_steal(&deques[victim], item)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void *worker(void *arg) {
+    WorkerStats *stats = (WorkerStats *)arg;
+    WorkItem item;
+    while (atomic_load(&pending_items) > 0) {
+        if (!find_work(stats, &item)) {
+            sched_yield();
+            continue;
+        }
+        if (item.is_dir) {
+            scan_directory(stats, item.parent, item.name);
+        } else {
+            scan_file(stats, item.parent, item.name);
+        }
+        dir_release(item.parent);
+        free(item.name);
+        atomic_fetch_sub(&pending_items, 1);
+    }
+    return NULL;
+}
+
+// Free everything uring_setup() created; safe on a partly set up ring
+void uring_teardown(Uring *ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, sizeof(struct io_uring_sqe) * (*ring->sq_mask + 1));
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd > 0) {
+        close(ring->fd); // Also unregisters the buffers
+    }
+    free(ring->buffers);
+    free(ring->files);
+    free(ring->free_slots);
+    memset(ring, 0, sizeof(Uring));
+}
+
+// Check that the kernel supports every request the engine sends
+static bool uring_supports_ops(int fd) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    bool ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    int needed[] = {IORING_OP_OPENAT, IORING_OP_READ_FIXED, IORING_OP_READ, IORING_OP_CLOSE};
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        ok = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+// Create a ring with room for depth requests and register one read buffer per slot
+int uring_setup(Uring *ring, int depth) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(Uring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (ring->fd < 0) {
+        ring->fd = 0;
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !uring_supports_ops(ring->fd)) {
+        errno = ENOSYS;
+        uring_teardown(ring);
+        return -1;
+    }
+    ring->depth = depth;
+
+    // The submission and completion rings share one mapping
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = ring->sq_ring_size;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_teardown(ring);
+        return -1;
+    }
+    ring->cq_ring = ring->sq_ring;
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->sqes = mmap(NULL, sizeof(struct io_uring_sqe) * params.sq_entries, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_teardown(ring);
+        return -1;
+    }
+
+    ring->buffers = aligned_alloc(4096, (size_t)depth * URING_BLOCK_SIZE);
+    ring->files = calloc(depth, sizeof(UringFile));
+    ring->free_slots = malloc(sizeof(int) * depth);
+    struct iovec *iov = malloc(sizeof(struct iovec) * depth);
+    if (ring->buffers == NULL || ring->files == NULL || ring->free_slots == NULL || iov == NULL) {
+        free(iov);
+        uring_teardown(ring);
+        return -1;
+    }
+    for (int i = 0; i < depth; i++) {
+        iov[i].iov_base = ring->buffers + (size_t)i * URING_BLOCK_SIZE;
+        iov[i].iov_len = URING_BLOCK_SIZE;
+        ring->free_slots[ring->num_free++] = depth - 1 - i;
+    }
+    ring->fixed_buffers = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, depth) == 0;
+    free(iov);
+    return 0;
+}
+
+// Queue one request. It is handed to the kernel by the next uring_enter().
+static void uring_push(Uring *ring, const struct io_uring_sqe *request) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    ring->sqes[index] = *request;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+// Submit queued requests and wait until at least one has completed
+static void uring_enter(Uring *ring) {
+    for (;;) {
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted >= 0) {
+            ring->to_submit -= submitted;
+            return;
+        }
+        if (errno != EINTR) {
+            // EBUSY/EAGAIN: completions have to be reaped before more can be submitted
+            return;
+        }
+    }
+}
+
+static void uring_open(Uring *ring, int slot) {
+    UringFile *file = &ring->files[slot];
+    struct io_uring_sqe request;
+    memset(&request, 0, sizeof(request));
+    request.opcode = IORING_OP_OPENAT;
+    request.fd = file->parent ? file->parent->fd : AT_FDCWD;
+    request.addr = (uintptr_t)file->name;
+    request.open_flags = O_RDONLY | O_NOFOLLOW | O_CLOEXEC;
+    request.user_data = slot;
+    file->stage = URING_OPEN;
+    uring_push(ring, &request);
+}
+
+static void uring_read(Uring *ring, int slot) {
+    UringFile *file = &ring->files[slot];
+    struct io_uring_sqe request;
+    memset(&request, 0, sizeof(request));
+    request.opcode = ring->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    request.fd = file->fd;
+    request.addr = (uintptr_t)(ring->buffers + (size_t)slot * URING_BLOCK_SIZE);
+    request.len = URING_BLOCK_SIZE;
+    request.off = file->offset;
+    request.buf_index = ring->fixed_buffers ? slot : 0;
+    request.user_data = slot;
+    file->stage = URING_READ;
+    uring_push(ring, &request);
+}
+
+static void uring_close(Uring *ring, int slot) {
+    UringFile *file = &ring->files[slot];
+    struct io_uring_sqe request;
+    memset(&request, 0, sizeof(request));
+    if (evict_after_scan) {
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    request.opcode = IORING_OP_CLOSE;
+    request.fd = file->fd;
+    request.user_data = slot;
+    file->stage = URING_CLOSE;
+    uring_push(ring, &request);
+}
+
+// The work item behind a slot is done: free it and give the slot back
+static void uring_release(Uring *ring, int slot) {
+    UringFile *file = &ring->files[slot];
+    dir_release(file->parent);
+    free(file->name);
+    ring->free_slots[ring->num_free++] = slot;
+    atomic_fetch_sub(&pending_items, 1);
+}
+
+// Move a file to its next step when its request completes. Reads are fed
+// straight from the registered buffer into the matcher.
+static void uring_complete(WorkerStats *stats, Uring *ring, int slot, int result) {
+    UringFile *file = &ring->files[slot];
+    switch (file->stage) {
+    case URING_OPEN:
+        if (result < 0) {
+            uring_release(ring, slot);
+            return;
+        }
+        stats->files++;
+        file->fd = result;
+        uring_read(ring, slot);
+        break;
+    case URING_READ:
+        if (result < 0) {
+            file->complete = false;
+            uring_close(ring, slot);
+            return;
+        }
+        file->offset += result;
+        stats->bytes += scan_buffer(&matcher, &file->state, ring->buffers + (size_t)slot * URING_BLOCK_SIZE,
+                                    result, &file->match_id);
+        // A short read does not mean the end of the file (a signal can cut it
+        // short), so stop only at a zero-byte read or at the size from stat
+        if (file->match_id >= 0 || result == 0 ||
+            (file->st.st_mode != 0 && file->offset >= file->st.st_size)) {
+            uring_close(ring, slot);
+        } else {
+            uring_read(ring, slot);
+        }
+        break;
+    case URING_CLOSE:
+        finish_file(stats, file->parent, file->name, &file->st, file->match_id, file->complete);
+        uring_release(ring, slot);
+        break;
+    }
+}
+
+// Worker for the io_uring engine: keeps up to queue_depth files in flight,
+// each moving through open, reads and close as its requests complete.
+// Directories are still listed synchronously when they come up.
+void *uring_worker(void *arg) {
+    WorkerStats *stats = (WorkerStats *)arg;
+    Uring *ring = &rings[stats->index];
+    WorkItem item;
+    while (atomic_load(&pending_items) > 0) {
+        while (ring->num_free > 0 && find_work(stats, &item)) {
+            if (item.is_dir) {
+                scan_directory(stats, item.parent, item.name);
+                dir_release(item.parent);
+                free(item.name);
+                atomic_fetch_sub(&pending_items, 1);
+                continue;
+            }
+            int slot = ring->free_slots[--ring->num_free];
+            UringFile *file = &ring->files[slot];
+            bool have_stat;
+            memset(file, 0, sizeof(UringFile));
+            file->parent = item.parent;
+            file->name = item.name;
+            file->match_id = -1;
+            file->complete = true;
+            if (check_cache(stats, item.parent, item.name, &file->st, &have_stat)) {
+                uring_release(ring, slot);
+                continue;
+            }
+            if (!have_stat) {
+                file->st.st_mode = 0; // Nothing to record in the cache
+            }
+            uring_open(ring, slot);
+        }
+        if (ring->num_free == ring->depth) {
+            sched_yield(); // Nothing in flight and nothing to take
+            continue;
+        }
+
+        uring_enter(ring);
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *completion = &ring->cqes[head & *ring->cq_mask];
+            int slot = (int)completion->user_data;
+            int result = completion->res;
+            // Free the completion entry before handling it, since handling queues new requests
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            uring_complete(stats, ring, slot, result);
+        }
+    }
+    return NULL;
+}
+
+// Compare the automaton against the old approach of fgets()-sized lines and
+// one strstr() per signature, using random signatures and random text
+void run_signature_benchmark() {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    int counts[] = {10, 1000, 100000};
+    unsigned seed = 12345;
+    unsigned char *data = malloc(BENCH_DATA_SIZE);
+    for (size_t i = 0; i < BENCH_DATA_SIZE; i++) {
+        unsigned r = rand_r(&seed);
+        data[i] = r % 80 == 0 ? '\n' : r % 7 == 0 ? ' ' : alphabet[r % 36];
+    }
+
+    printf("Data: %d MB of random text\n", BENCH_DATA_SIZE >> 20);
+    printf("%10s %9s %7s %10s %9s %12s %12s %9s %9s %9s\n", "signatures", "states", "form", "table MB",
+           "build ms", "AC MB/sec", "strstr MB/s", "speedup", "AC hits", "line hits");
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        SignatureMatcher bench = {0};
+        char text[32];
+        for (int i = 0; i < counts[c]; i++) {
+            int length = 8 + rand_r(&seed) % 9;
+            for (int j = 0; j < length; j++) {
+                text[j] = alphabet[rand_r(&seed) % 36];
+            }
+            text[length] = 0;
+            add_signature(&bench, text);
+        }
+        double start = now_seconds();
+        if (compile_signatures(&bench) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        double build = now_seconds() - start;
+
+        start = now_seconds();
+        uint32_t state = 0;
+        long matches = 0;
+        for (size_t pos = 0; pos < BENCH_DATA_SIZE;) {
+            int match_id;
+            pos += matcher_scan(&bench, &state, data + pos, BENCH_DATA_SIZE - pos, &match_id);
+            matches += match_id >= 0;
         }
+        double ac_rate = BENCH_DATA_SIZE / 1e6 / (now_seconds() - start);
+
+        // The strstr loop is far slower with many signatures, so it only runs for about a second
+        start = now_seconds();
+        size_t scanned = 0;
+        long line_matches = 0; // Counted so the compiler cannot drop the pure strstr calls
+        char line[256];
+        while (scanned < BENCH_DATA_SIZE && now_seconds() - start < 1.0) {
+            size_t length = 0;
+            while (scanned < BENCH_DATA_SIZE && length < sizeof(line) - 1) {
+                line[length++] = data[scanned++];
+                if (line[length - 1] == '\n') {
+                    break;
+                }
+            }
+            line[length] = 0;
+            for (int i = 0; i < bench.num_signatures; i++) {
+                if (strstr(line, bench.names[i])) {
+                    line_matches++;
+                    break;
+                }
+            }
+        }
+        double strstr_rate = scanned / 1e6 / (now_seconds() - start);
+
+        printf("%10d %9d %7s %10.1f %9.1f %12.1f %12.2f %8.0fx %9ld %9ld\n", counts[c], bench.num_states,
+               bench.table ? "dense" : "sparse", matcher_memory(&bench) / 1e6, build * 1e3,
+               ac_rate, strstr_rate, ac_rate / strstr_rate, matches, line_matches);
+        free_signatures(&bench);
     }
+    free(data);
+}
 
-    closedir(dir);
+// User plus system CPU time of the whole process
+static double cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
 }
 
-int main() {
-    scan_directory(".");
+// Allow as many open directories as the hard limit permits, and as much
+// locked memory, which registered io_uring buffers are charged against
+static void raise_limits() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_MEMLOCK, &limit);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *roots[MAX_THREADS];
+    const char *signature_file = NULL;
+    const char *cache_file = NULL;
+    int num_roots = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--signatures") == 0 && i + 1 < argc) {
+            signature_file = argv[++i];
+        } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc && (strcmp(argv[i + 1], "mmap") == 0 ||
+                                                                   strcmp(argv[i + 1], "read") == 0)) {
+            use_mmap = strcmp(argv[++i], "mmap") == 0;
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache_file = argv[++i];
+        } else if (strcmp(argv[i], "--uring") == 0) {
+            use_uring = true;
+        } else if (strcmp(argv[i], "--queue-depth") == 0 && i + 1 < argc) {
+            queue_depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-prefilter") == 0) {
+            use_prefilter = false;
+        } else if (strcmp(argv[i], "--evict") == 0) {
+            evict_after_scan = true;
+        } else if (strcmp(argv[i], "--bench-signatures") == 0) {
+            run_signature_benchmark();
+            return 0;
+        } else if (argv[i][0] == '-' || num_roots == MAX_THREADS) {
+            printf("Usage: %s [--threads N] [--signatures FILE] [--io mmap|read] [--no-prefilter] [--evict]\n"
+                   "       [--cache FILE] [--uring] [--queue-depth N] [--bench-signatures] [directory...]\n", argv[0]);
+            return 1;
+        } else {
+            roots[num_roots++] = argv[i];
+        }
+    }
+    if (num_workers < 1 || num_workers > MAX_THREADS) {
+        fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_THREADS);
+        return 1;
+    }
+    if (queue_depth < 1 || queue_depth > MAX_QUEUE_DEPTH) {
+        fprintf(stderr, "Queue depth must be between 1 and %d\n", MAX_QUEUE_DEPTH);
+        return 1;
+    }
+    if (num_roots == 0) {
+        roots[num_roots++] = ".";
+    }
+    if (signature_file != NULL) {
+        if (load_signatures(&matcher, signature_file) != 0) {
+            return 1;
+        }
+    } else {
+        add_signature(&matcher, DEFAULT_SIGNATURE);
+    }
+    if (matcher.num_signatures == 0) {
+        fprintf(stderr, "No signatures loaded\n");
+        return 1;
+    }
+    if (compile_signatures(&matcher) != 0) {
+        return 1;
+    }
+    if (cache_file != NULL && cache_open(&cache, cache_file, signature_db_version(&matcher)) != 0) {
+        return 1;
+    }
+    raise_limits();
+    for (int i = 0; use_uring && i < num_workers; i++) {
+        if (uring_setup(&rings[i], queue_depth) != 0) {
+            fprintf(stderr, "io_uring unavailable (%s), using the threaded engine\n", strerror(errno));
+            while (i > 0) {
+                uring_teardown(&rings[--i]);
+            }
+            use_uring = false;
+        }
+    }
+
+    WorkerStats *stats = aligned_alloc(64, sizeof(WorkerStats) * num_workers);
+    for (int i = 0; i < num_workers; i++) {
+        memset(&stats[i], 0, sizeof(WorkerStats));
+        stats[i].index = i;
+        stats[i].seed = 2654435761u * (i + 1);
+        stats[i].buffer = malloc(SCAN_BLOCK_SIZE);
+        deque_init(&deques[i]);
+    }
+    for (int i = 0; i < num_roots; i++) {
+        submit(&stats[i % num_workers], NULL, roots[i], true);
+    }
+
+    double start = now_seconds();
+    double cpu_start = cpu_seconds();
+    pthread_t threads[MAX_THREADS];
+    for (int i = 0; i < num_workers; i++) {
+        pthread_create(&threads[i], NULL, use_uring ? uring_worker : worker, &stats[i]);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    double cpu = cpu_seconds() - cpu_start;
+
+    if (cache.enabled) {
+        cache_append(&cache, stats, num_workers);
+    }
+    long files = 0, bytes = 0, infected = 0, cached = 0;
+    for (int i = 0; i < num_workers; i++) {
+        files += stats[i].files;
+        bytes += stats[i].bytes;
+        infected += stats[i].infected;
+        cached += stats[i].cached;
+        free(stats[i].buffer);
+        free(stats[i].new_records);
+        deque_destroy(&deques[i]);
+    }
+    char engine[64];
+    if (use_uring) {
+        snprintf(engine, sizeof(engine), "io_uring depth %d%s", queue_depth,
+                 rings[0].fixed_buffers ? ", registered buffers" : "");
+    } else {
+        snprintf(engine, sizeof(engine), "%s", use_mmap ? "mmap" : "pread");
+    }
+    printf("Scanned %ld files (%.1f MB) in %.3f s with %d threads: %.0f files/sec, %.1f MB/sec, %ld infected\n",
+           files, bytes / 1e6, elapsed, num_workers, files / elapsed, bytes / 1e6 / elapsed, infected);
+    printf("CPU time %.3f s: %.1f MB/sec per core (%s, prefilter %s)\n", cpu, cpu > 0 ? bytes / 1e6 / cpu : 0.0,
+           engine, !use_prefilter || matcher.prefilter_count == 0 ? "off" : matcher.prefilter_pairs ? "byte pairs" : "first bytes");
+    if (cache.enabled) {
+        printf("Scan cache: %ld unchanged files skipped, %zu verdicts indexed at startup\n", cached, cache.live);
+    }
+    for (int i = 0; use_uring && i < num_workers; i++) {
+        uring_teardown(&rings[i]);
+    }
+    free(stats);
+    cache_close(&cache);
+    free_signatures(&matcher);
 
     return 0;
 }
@@ -1,4 +1,5 @@
 // Joseph Clauss
+#define _GNU_SOURCE // memmem
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -6,80 +7,1280 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <stdint.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 
 #define MAX_LINE 1024
 #define MAX_ARGS 64
+#define MAX_JOBS 64
+#define HASH_SIZE 256          // Slots in the command hash table, a power of two
+#define MAX_PATH_DIRS 128      // PATH directories whose mtimes are watched
+#define HASH_CHECK_INTERVAL 1  // Seconds between checks of those mtimes
 
-// Global variable to keep track of child processes
-pid_t child_pid = -1;
+// Tokenizer shared by the shells. parse_line() reads the line once and
+// writes the unquoted words into the ParsedLine, which holds every word,
+// command and pipeline of the line, so nothing is allocated per token and
+// no state is kept between calls; it is safe to call from any thread.
+// Understands '...' and "..." quoting, backslash escapes, ;, &, |, &&, ||,
+// <, > and >>. Input that does not fit is an error, never cut short.
+#define MAX_WORDS 256
+#define MAX_STAGES 64
+#define MAX_PIPELINES 64
 
-// Signal handler to exit the shell
-void exit_shell(int sig) {
-    printf("\nExiting shell...\n");
-    exit(0);
+// When a pipeline runs, based on the status of the one before it
+typedef enum {
+    RUN_ALWAYS,     // First pipeline, or after ";" or "&"
+    RUN_IF_SUCCESS, // After "&&"
+    RUN_IF_FAILURE  // After "||"
+} RunCondition;
+
+// One stage of a pipeline with its redirections
+typedef struct {
+    char **args;  // NULL-terminated, points into the line's word list
+    int argc;
+    char *input;  // File for "<", or NULL
+    char *output; // File for ">" or ">>", or NULL
+    int append;   // Set for ">>"
+} Command;
+
+typedef struct {
+    Command *stages;
+    int num_stages;
+    int background; // Ended by "&"
+    RunCondition condition;
+} Pipeline;
+
+typedef struct {
+    char text[MAX_LINE + 1];  // Unquoted words, each NUL-terminated
+    char *words[MAX_WORDS];   // Argument lists of every command, each ending in NULL
+    Command commands[MAX_STAGES];
+    Pipeline pipelines[MAX_PIPELINES];
+    int num_words;
+    int num_commands;
+    int num_pipelines;
+    const char *error;        // Why parse_line() failed
+} ParsedLine;
+
+// A background job: every process of one pipeline started with "&"
+typedef struct {
+    int id;       // Job number shown to the user, 0 for a free slot
+    pid_t pids[MAX_STAGES];
+    int num_pids;
+    int running;  // Processes that have not been reaped yet
+    char command[MAX_LINE];
+} Job;
+
+// One line of a batch file run with -j
+typedef struct {
+    char line[MAX_LINE];  // Text as read, printed before its output
+    ParsedLine parsed;
+    int next_pipeline;
+    pid_t pids[MAX_STAGES]; // Processes of the pipeline that is running
+    int num_pids;
+    int running;          // Of those, processes not yet reaped
+    int status;           // Exit status of the last pipeline that finished
+    FILE *output;         // Captured output of every command on the line
+    int done;
+} BatchLine;
+
+// Processes of the pipeline running in the foreground
+pid_t foreground_pids[MAX_STAGES]; // 0 once reaped
+int num_foreground = 0;
+int foreground_running = 0;         // Of those, processes not yet reaped
+int foreground_status = 0;          // Exit status of the pipeline so far
+int num_children = 0;               // Started processes not yet reaped
+
+// Signals are read from signal_fd in the main loop once setup_signals() ran
+int signal_fd = -1;
+int interrupted = 0; // SIGINT arrived; stops the rest of the line or batch
+int at_prompt = 0;   // The prompt is on screen, so notices have to move it
+
+Job jobs[MAX_JOBS];
+int next_job_id = 1;
+
+extern char **environ;
+
+// Function to block SIGINT, SIGQUIT and SIGCHLD and receive them through
+// a signalfd instead, so they are handled by the main loop at a safe point
+// rather than by handlers that can interrupt anything, such as printf
+void setup_signals() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGQUIT);
+    sigaddset(&signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        perror("signalfd failed");
+        exit(1);
+    }
 }
 
-// Signal handler to end the execution of the current command
-void end_execution(int sig) {
-    if (child_pid > 0) {
-        kill(child_pid, SIGKILL); // Kill the child process
-        printf("\nCommand interrupted. Returning to prompt...\n");
+// Readline's line while a notice is printed over the prompt
+char *saved_line = NULL;
+int saved_point = 0;
+int quit_shell = 0;
+
+// Function to clear the prompt and the line being edited off the screen
+// before printing a notice
+void hide_prompt() {
+    if (at_prompt) {
+        saved_point = rl_point;
+        saved_line = rl_copy_text(0, rl_end);
+        rl_save_prompt();
+        rl_replace_line("", 0);
+        rl_redisplay();
+        at_prompt = 0;
     }
 }
 
-// Function to split the input into commands using ";" as the delimiter
-void split_commands(char *input, char **commands) {
-    char *token = strtok(input, ";");
-    int i = 0;
-    while (token != NULL && i < MAX_ARGS - 1) {
-        commands[i++] = token;
-        token = strtok(NULL, ";");
+// Function to bring back the prompt and the line hide_prompt() cleared
+void show_prompt() {
+    rl_restore_prompt();
+    rl_replace_line(saved_line, 0);
+    rl_point = saved_point;
+    rl_redisplay();
+    free(saved_line);
+    saved_line = NULL;
+    at_prompt = 1;
+}
+
+// Character classes for the tokenizer's inner loops
+enum { CHAR_WORD, CHAR_SPACE, CHAR_OPERATOR, CHAR_QUOTE };
+static const unsigned char char_class[256] = {
+    ['\0'] = CHAR_OPERATOR, [';'] = CHAR_OPERATOR, ['&'] = CHAR_OPERATOR, ['|'] = CHAR_OPERATOR,
+    ['<'] = CHAR_OPERATOR, ['>'] = CHAR_OPERATOR, [' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\n'] = CHAR_SPACE,
+    ['\''] = CHAR_QUOTE, ['"'] = CHAR_QUOTE, ['\\'] = CHAR_QUOTE,
+};
+
+// Function to start a command, and a pipeline for it if none is open
+static Command *begin_command(ParsedLine *parsed, Pipeline **pipeline, RunCondition condition) {
+    if (parsed->num_commands == MAX_STAGES || (*pipeline == NULL && parsed->num_pipelines == MAX_PIPELINES)) {
+        parsed->error = "Too many commands on one line";
+        return NULL;
+    }
+    if (*pipeline == NULL) {
+        *pipeline = &parsed->pipelines[parsed->num_pipelines++];
+        (*pipeline)->stages = &parsed->commands[parsed->num_commands];
+        (*pipeline)->num_stages = 0;
+        (*pipeline)->background = 0;
+        (*pipeline)->condition = condition;
     }
-    commands[i] = NULL;
+    Command *command = &parsed->commands[parsed->num_commands++];
+    (*pipeline)->num_stages++;
+    command->args = &parsed->words[parsed->num_words];
+    command->argc = 0;
+    command->input = command->output = NULL;
+    command->append = 0;
+    return command;
 }
 
-// Function to parse the command into arguments using whitespace as the delimiter
-void parse_command(char *cmd, char **args) {
-    char *token = strtok(cmd, " \n");
-    int i = 0;
-    while (token != NULL && i < MAX_ARGS - 1) {
-        args[i++] = token;
-        token = strtok(NULL, " \n");
+// Function to split a line into pipelines, commands and words.
+// Returns 0 on success, or -1 with parsed->error set.
+int parse_line(const char *line, ParsedLine *parsed) {
+    const char *read = line;
+    char *write = parsed->text;
+    Pipeline *pipeline = NULL; // Pipeline being filled
+    Command *command = NULL;   // Command being filled
+    char **target = NULL;      // Redirection waiting for its file name
+    RunCondition condition = RUN_ALWAYS;
+    int need_command = 0;      // Set after "|", "&&" and "||"
+
+    parsed->num_words = parsed->num_commands = parsed->num_pipelines = 0;
+    parsed->error = NULL;
+    if (strlen(line) >= MAX_LINE) {
+        parsed->error = "Line too long";
+        return -1;
     }
-    args[i] = NULL;
+
+    for (;;) {
+        while (char_class[(unsigned char)*read] == CHAR_SPACE) {
+            read++;
+        }
+        char c = *read;
+        if (c == '\0' || c == ';' || c == '&' || c == '|') {
+            int two = c != '\0' && c != ';' && read[1] == c; // "&&" or "||"
+            if (target != NULL) {
+                parsed->error = "Missing file name for redirection";
+                return -1;
+            }
+            if (command != NULL) {
+                if (command->argc == 0) {
+                    parsed->error = "Syntax error: missing command";
+                    return -1;
+                }
+                parsed->words[parsed->num_words++] = NULL; // Room was kept when the words were added
+                command = NULL;
+            } else if (need_command || c == '&' || c == '|') {
+                // Only ";" may follow nothing; "|", "&", "&&" and "||" need a command before them
+                parsed->error = "Syntax error: missing command";
+                return -1;
+            }
+            if (c == '\0') {
+                break;
+            }
+            read += two ? 2 : 1;
+            need_command = c == '|' || two;
+            if (c == '|' && !two) {
+                continue; // Next stage of the same pipeline
+            }
+            if (pipeline != NULL) {
+                pipeline->background = c == '&' && !two;
+            }
+            pipeline = NULL;
+            condition = !two ? RUN_ALWAYS : c == '&' ? RUN_IF_SUCCESS : RUN_IF_FAILURE;
+            continue;
+        }
+        if (command == NULL && (command = begin_command(parsed, &pipeline, condition)) == NULL) {
+            return -1;
+        }
+        if (c == '<' || c == '>') {
+            if (target != NULL) {
+                parsed->error = "Missing file name for redirection";
+                return -1;
+            }
+            if (c == '<') {
+                target = &command->input;
+            } else {
+                target = &command->output;
+                command->append = read[1] == '>';
+                read += command->append;
+            }
+            read++;
+            continue;
+        }
+
+        // A word: runs until unquoted whitespace or an operator
+        char *word = write;
+        for (;;) {
+            unsigned char kind = char_class[(unsigned char)*read];
+            if (kind == CHAR_WORD) {
+                *write++ = *read++;
+                continue;
+            }
+            if (kind != CHAR_QUOTE) {
+                break;
+            }
+            if (*read == '\'') {
+                const char *end = strchr(read + 1, '\'');
+                if (end == NULL) {
+                    parsed->error = "Unterminated quote";
+                    return -1;
+                }
+                memcpy(write, read + 1, end - read - 1);
+                write += end - read - 1;
+                read = end + 1;
+            } else if (*read == '"') {
+                for (read++; *read != '"'; read++) {
+                    if (*read == '\0') {
+                        parsed->error = "Unterminated quote";
+                        return -1;
+                    }
+                    if (*read == '\\' && read[1] != '\0' && strchr("\"\\$`", read[1])) {
+                        read++;
+                    }
+                    *write++ = *read;
+                }
+                read++;
+            } else if (read[1] != '\0') {
+                *write++ = read[1]; // Backslash escape
+                read += 2;
+            } else {
+                *write++ = *read++; // A backslash at the very end stays as it is
+            }
+        }
+        *write++ = '\0';
+        if (target != NULL) {
+            *target = word;
+            target = NULL;
+            continue;
+        }
+        if (parsed->num_words >= MAX_WORDS - 1) {
+            parsed->error = "Too many words on one line";
+            return -1;
+        }
+        parsed->words[parsed->num_words++] = word;
+        command->argc++;
+        need_command = 0;
+    }
+    return 0;
 }
 
-// Function to execute a single command
-void execute_command(char **args) {
-    child_pid = fork();
-    if (child_pid < 0) {
+// Command hash table, like the hash builtin of other shells. Looking a
+// command up in PATH costs a failed probe for every directory before the
+// one that has it, so the resolved path is remembered by name. The table
+// is emptied when PATH changes, and when the mtime of a PATH directory
+// changes (checked at most once every HASH_CHECK_INTERVAL seconds), so
+// newly installed programs are found. "hash -r" empties it by hand.
+typedef struct {
+    char *name;
+    char *path;
+    int hits;
+} HashEntry;
+
+HashEntry command_hash[HASH_SIZE];
+int num_hashed = 0;
+int use_hash = 1;                           // 0 leaves every lookup to posix_spawnp
+char *hashed_path_var = NULL;               // PATH the table was filled from
+struct timespec path_dir_mtimes[MAX_PATH_DIRS];
+int num_path_dirs = 0;
+time_t last_hash_check = 0;
+long path_probes = 0;                       // Directories tried by search_path()
+
+// Function to get PATH, with the same default execvp uses when it is unset
+static const char *path_variable() {
+    const char *path_var = getenv("PATH");
+    return path_var != NULL ? path_var : "/bin:/usr/bin";
+}
+
+// Function to empty the command hash table
+void hash_clear() {
+    for (int i = 0; i < HASH_SIZE; i++) {
+        free(command_hash[i].name);
+        free(command_hash[i].path);
+        command_hash[i].name = command_hash[i].path = NULL;
+    }
+    num_hashed = 0;
+}
+
+// Function to read the mtime of every PATH directory, so a later change
+// to any of them can be noticed. Returns 1 if they differ from last time.
+static int snapshot_path_dirs(const char *path_var) {
+    char dir[PATH_MAX];
+    int changed = 0, count = 0;
+    for (const char *p = path_var; count < MAX_PATH_DIRS; p++) {
+        size_t len = strcspn(p, ":");
+        struct stat st;
+        snprintf(dir, sizeof(dir), "%.*s", (int)len, len > 0 ? p : ".");
+        if (stat(dir, &st) != 0) {
+            st.st_mtim.tv_sec = st.st_mtim.tv_nsec = 0;
+        }
+        if (count >= num_path_dirs || st.st_mtim.tv_sec != path_dir_mtimes[count].tv_sec ||
+            st.st_mtim.tv_nsec != path_dir_mtimes[count].tv_nsec) {
+            changed = 1;
+        }
+        path_dir_mtimes[count++] = st.st_mtim;
+        p += len;
+        if (*p == '\0') {
+            break;
+        }
+    }
+    changed |= count != num_path_dirs;
+    num_path_dirs = count;
+    return changed;
+}
+
+// Function to empty the table if PATH or one of its directories changed
+static void check_hash() {
+    const char *path_var = path_variable();
+    time_t now = time(NULL);
+    if (hashed_path_var == NULL || strcmp(hashed_path_var, path_var) != 0) {
+        hash_clear();
+        free(hashed_path_var);
+        hashed_path_var = strdup(path_var);
+        snapshot_path_dirs(path_var);
+        last_hash_check = now;
+    } else if (now - last_hash_check >= HASH_CHECK_INTERVAL) {
+        last_hash_check = now;
+        if (snapshot_path_dirs(path_var)) {
+            hash_clear();
+        }
+    }
+}
+
+// Function to find an executable regular file called name in PATH, the way
+// execvp would. Returns path filled in, or NULL if there is none.
+static char *search_path(const char *name, char *path, size_t size) {
+    const char *p = path_variable();
+    for (;;) {
+        size_t len = strcspn(p, ":");
+        struct stat st;
+        path_probes++;
+        if (snprintf(path, size, "%.*s/%s", (int)len, len > 0 ? p : ".", name) < (int)size &&
+            stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0) {
+            return path;
+        }
+        p += len;
+        if (*p++ == '\0') {
+            return NULL;
+        }
+    }
+}
+
+// Function to hash a command name (FNV-1a) to its first table slot
+static unsigned hash_slot(const char *name) {
+    unsigned h = 2166136261u;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h & (HASH_SIZE - 1);
+}
+
+// Function to resolve a command name to the path to run, from the table
+// when it is there. Names containing a slash are used as they are.
+// Returns path filled in, or NULL if the command was not found; *hashed
+// tells whether the answer came from the table.
+char *find_command(const char *name, char *path, size_t size, int *hashed) {
+    *hashed = 0;
+    if (strchr(name, '/') != NULL) {
+        snprintf(path, size, "%s", name);
+        return path;
+    }
+    check_hash();
+    unsigned slot = hash_slot(name);
+    while (command_hash[slot].name != NULL) {
+        if (strcmp(command_hash[slot].name, name) == 0) {
+            command_hash[slot].hits++;
+            *hashed = 1;
+            snprintf(path, size, "%s", command_hash[slot].path);
+            return path;
+        }
+        slot = (slot + 1) & (HASH_SIZE - 1);
+    }
+    if (search_path(name, path, size) == NULL) {
+        return NULL;
+    }
+    if (num_hashed < HASH_SIZE / 2) { // Keep probe sequences short
+        command_hash[slot].name = strdup(name);
+        command_hash[slot].path = strdup(path);
+        command_hash[slot].hits = 1;
+        num_hashed++;
+    }
+    return path;
+}
+
+// Function to start one command, finding it through the hash table. An
+// entry for a program that has since gone away is dropped and PATH is
+// searched again. Returns 0 or an errno value, like posix_spawn.
+int spawn_command(pid_t *pid, char **args, posix_spawn_file_actions_t *actions, posix_spawnattr_t *attributes) {
+    if (!use_hash) {
+        return posix_spawnp(pid, args[0], actions, attributes, args, environ);
+    }
+    char path[PATH_MAX];
+    int hashed, error = ENOENT;
+    if (find_command(args[0], path, sizeof(path), &hashed) != NULL) {
+        error = posix_spawn(pid, path, actions, attributes, args, environ);
+        if (error == ENOENT && hashed && access(path, X_OK) != 0) {
+            hash_clear();
+            return spawn_command(pid, args, actions, attributes);
+        }
+    }
+    return error;
+}
+
+// Function to list the remembered commands for the hash builtin
+void list_hash(FILE *out) {
+    if (num_hashed == 0) {
+        fprintf(out, "hash: hash table empty\n");
+        return;
+    }
+    fprintf(out, "hits\tcommand\n");
+    for (int i = 0; i < HASH_SIZE; i++) {
+        if (command_hash[i].name != NULL) {
+            fprintf(out, "%4d\t%s\n", command_hash[i].hits, command_hash[i].path);
+        }
+    }
+}
+
+// Function to start every stage of a pipeline with posix_spawn. The child
+// wiring (pipes and redirections) is described with file actions so the
+// shell never has to fork and copy its own address space. When out is not
+// stdout, the output and errors of every stage are sent to it instead.
+int spawn_pipeline(Pipeline *pipeline, pid_t *pids, FILE *out) {
+    Command *commands = pipeline->stages;
+    int count = pipeline->num_stages;
+    int background = pipeline->background;
+    int previous_read = -1; // Read end of the pipe feeding the next stage
+    int started = 0;
+    int capture = out != stdout ? fileno(out) : -1;
+    posix_spawnattr_t attributes;
+    sigset_t no_signals, default_signals;
+    sigemptyset(&no_signals);
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGINT);
+    sigaddset(&default_signals, SIGQUIT);
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setsigmask(&attributes, &no_signals); // Undo what setup_signals() blocked
+    posix_spawnattr_setsigdefault(&attributes, &default_signals);
+    fflush(out); // Keep our own output ahead of the children's
+    if (background) {
+        // Background jobs get their own process group so terminal signals skip them
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+        posix_spawnattr_setpgroup(&attributes, 0);
+    } else {
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    }
+
+    for (int i = 0; i < count; i++) {
+        int pipe_fds[2] = {-1, -1};
+        if (i < count - 1 && pipe(pipe_fds) < 0) {
+            perror("Pipe failed");
+            break;
+        }
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (capture >= 0) {
+            posix_spawn_file_actions_adddup2(&actions, capture, STDOUT_FILENO);
+            posix_spawn_file_actions_adddup2(&actions, capture, STDERR_FILENO);
+        }
+        if (previous_read >= 0) {
+            posix_spawn_file_actions_adddup2(&actions, previous_read, STDIN_FILENO);
+            posix_spawn_file_actions_addclose(&actions, previous_read);
+        }
+        if (pipe_fds[1] >= 0) {
+            posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+            posix_spawn_file_actions_addclose(&actions, pipe_fds[1]);
+            posix_spawn_file_actions_addclose(&actions, pipe_fds[0]);
+        }
+        if (commands[i].input != NULL) {
+            posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, commands[i].input, O_RDONLY, 0);
+        }
+        if (commands[i].output != NULL) {
+            int flags = O_WRONLY | O_CREAT | (commands[i].append ? O_APPEND : O_TRUNC);
+            posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, commands[i].output, flags, 0644);
+        }
+
+        int error = spawn_command(&pids[started], commands[i].args, &actions, &attributes);
+        posix_spawn_file_actions_destroy(&actions);
+        if (error != 0) {
+            fprintf(out == stdout ? stderr : out, "Exec failed: %s: %s\n", commands[i].args[0], strerror(error));
+        } else {
+            if (background && started == 0) {
+                posix_spawnattr_setpgroup(&attributes, pids[0]); // Later stages join the first one's group
+            }
+            started++;
+            num_children++;
+        }
+        if (previous_read >= 0) {
+            close(previous_read);
+        }
+        if (pipe_fds[1] >= 0) {
+            close(pipe_fds[1]);
+        }
+        previous_read = pipe_fds[0];
+    }
+    if (previous_read >= 0) {
+        close(previous_read);
+    }
+    posix_spawnattr_destroy(&attributes);
+    return started;
+}
+
+// Function to add a started background pipeline to the job table
+void add_job(pid_t *pids, int count, const char *text, FILE *out) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id == 0) {
+            jobs[i].id = next_job_id++;
+            memcpy(jobs[i].pids, pids, sizeof(pid_t) * count);
+            jobs[i].num_pids = jobs[i].running = count;
+            snprintf(jobs[i].command, sizeof(jobs[i].command), "%s", text);
+            fprintf(out, "[%d] %d\n", jobs[i].id, (int)pids[count - 1]);
+            return;
+        }
+    }
+    // Table full: the processes still run, but are only reaped, not tracked
+    fprintf(out, "Job table full, not tracking background command\n");
+}
+
+// Function to account for a reaped background process and report its job
+// once every process of the job has finished
+void job_process_done(pid_t pid) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        for (int j = 0; jobs[i].id != 0 && j < jobs[i].num_pids; j++) {
+            if (jobs[i].pids[j] == pid && --jobs[i].running == 0) {
+                hide_prompt();
+                printf("[%d] Done    %s\n", jobs[i].id, jobs[i].command);
+                jobs[i].id = 0;
+            }
+        }
+    }
+}
+
+// Function to account for a reaped process, foreground or background
+void child_exited(pid_t pid, int status) {
+    num_children--;
+    for (int i = 0; i < num_foreground; i++) {
+        if (foreground_pids[i] == pid) {
+            foreground_pids[i] = 0;
+            foreground_running--;
+            if (i == num_foreground - 1 && foreground_status == 0) {
+                // The last stage decides the status, as in other shells
+                foreground_status = status;
+            }
+            return;
+        }
+    }
+    job_process_done(pid);
+}
+
+// Function to turn what waitid() reports into an exit status
+static int exit_status(siginfo_t *info) {
+    return info->si_code == CLD_EXITED ? info->si_status : 128 + info->si_status;
+}
+
+// Function to reap every process that has finished, without blocking
+void reap_children() {
+    siginfo_t info;
+    for (;;) {
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG) != 0 || info.si_pid == 0) {
+            return;
+        }
+        child_exited(info.si_pid, exit_status(&info));
+    }
+}
+
+// Function to handle every signal waiting on the signalfd. SIGINT and
+// SIGQUIT from the terminal already reached the foreground processes,
+// which share our process group; ones sent to the shell alone are passed
+// on to them. Our children are only reaped here, so their pids can not be
+// reused while we signal them.
+void handle_signals() {
+    struct signalfd_siginfo info;
+    int reap = 0;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGCHLD) {
+            reap = 1;
+            continue;
+        }
+        for (int i = 0; i < num_foreground && info.ssi_code != SI_KERNEL; i++) {
+            if (foreground_pids[i] != 0) {
+                kill(foreground_pids[i], info.ssi_signo);
+            }
+        }
+        if (info.ssi_signo == SIGINT) {
+            interrupted = 1;
+        }
+    }
+    if (reap) {
+        reap_children();
+    }
+}
+
+// Function to block until a child finishes or a signal arrives, and handle it
+void wait_for_event() {
+    if (signal_fd >= 0) {
+        struct pollfd fd = {signal_fd, POLLIN, 0};
+        if (poll(&fd, 1, -1) > 0) {
+            handle_signals();
+        }
+        return;
+    }
+    siginfo_t info;
+    if (waitid(P_ALL, 0, &info, WEXITED) == 0) {
+        child_exited(info.si_pid, exit_status(&info));
+    } else if (errno == ECHILD) {
+        num_children = 0;
+    }
+}
+
+// Function to reap background processes and report jobs that finished.
+// With wait_all set, waits until every background job is done or SIGINT.
+void reap_jobs(int wait_all) {
+    reap_children();
+    while (wait_all && num_children > 0 && !interrupted) {
+        wait_for_event();
+    }
+}
+
+// Function to list the background jobs that are still running
+void list_jobs(FILE *out) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id != 0) {
+            fprintf(out, "[%d] Running %s\n", jobs[i].id, jobs[i].command);
+        }
+    }
+}
+
+// Function to write a pipeline back out as text, for the job table
+void describe_pipeline(Pipeline *pipeline, char *text, size_t size) {
+    size_t length = 0;
+    text[0] = '\0';
+    for (int i = 0; i < pipeline->num_stages; i++) {
+        Command *command = &pipeline->stages[i];
+        for (int j = 0; j < command->argc && length < size; j++) {
+            length += snprintf(text + length, size - length, "%s%s", length > 0 ? (j == 0 ? " | " : " ") : "",
+                               command->args[j]);
+        }
+    }
+}
+
+// Function to start one pipeline: a builtin, a background job or a
+// foreground pipeline. Messages go to out. Returns the number of
+// foreground processes started, which the caller has to wait for; when
+// there are none, *status tells whether the pipeline failed.
+int start_command(Pipeline *pipeline, FILE *out, pid_t *pids, int *status) {
+    Command *first = &pipeline->stages[0];
+    *status = 0;
+    if (pipeline->num_stages == 1 && strcmp(first->args[0], "jobs") == 0) {
+        list_jobs(out);
+        return 0;
+    }
+    if (pipeline->num_stages == 1 && strcmp(first->args[0], "hash") == 0) {
+        if (first->argc > 1 && strcmp(first->args[1], "-r") == 0) {
+            hash_clear();
+        } else {
+            list_hash(out);
+        }
+        return 0;
+    }
+    if (pipeline->num_stages == 1 && strcmp(first->args[0], "wait") == 0) {
+        if (out == stdout) {
+            reap_jobs(1);
+        } else {
+            fprintf(out, "wait has to be on a line of its own in -j mode\n");
+        }
+        return 0;
+    }
+
+    int started = spawn_pipeline(pipeline, pids, out);
+    if (started < pipeline->num_stages) {
+        *status = 127; // Some stage could not be started
+    }
+    if (pipeline->background && started > 0) {
+        char text[MAX_LINE];
+        describe_pipeline(pipeline, text, sizeof(text));
+        add_job(pids, started, text, out);
+        return 0;
+    }
+    return started;
+}
+
+// Function to run one pipeline and wait for it. Returns its exit status.
+int execute_command(Pipeline *pipeline) {
+    pid_t pids[MAX_STAGES];
+    int status;
+    int started = start_command(pipeline, stdout, pids, &status);
+
+    // Wait for every stage; child_exited() keeps the count and the status
+    memcpy(foreground_pids, pids, sizeof(pid_t) * started);
+    num_foreground = foreground_running = started;
+    foreground_status = status;
+    while (foreground_running > 0) {
+        wait_for_event();
+    }
+    num_foreground = 0;
+    return foreground_status;
+}
+
+// Function to decide whether a pipeline runs, given how it is joined to the one before
+int should_run(Pipeline *pipeline, int last_status) {
+    return pipeline->condition == RUN_ALWAYS || (pipeline->condition == RUN_IF_SUCCESS) == (last_status == 0);
+}
+
+// Function to execute every pipeline of a line, honouring ";", "&", "&&" and "||"
+void execute_commands(char *line) {
+    ParsedLine parsed;
+    int status = 0;
+    if (parse_line(line, &parsed) != 0) {
+        fprintf(stderr, "%s\n", parsed.error);
+        return;
+    }
+    for (int i = 0; i < parsed.num_pipelines && !interrupted; i++) {
+        if (should_run(&parsed.pipelines[i], status)) {
+            status = execute_command(&parsed.pipelines[i]);
+        }
+    }
+    reap_jobs(0);
+}
+
+// Function to execute a single command the old way, with fork() and execvp().
+// Only kept as the baseline for the spawn benchmark.
+void fork_command(char **args) {
+    pid_t pid = fork();
+    if (pid < 0) {
         perror("Fork failed");
         exit(1);
-    } else if (child_pid == 0) {
-        // Child process executes the command
+    } else if (pid == 0) {
         if (execvp(args[0], args) == -1) {
             perror("Exec failed");
             exit(1);
         }
     } else {
-        // Parent process waits for the child to complete
         int status;
-        waitpid(child_pid, &status, 0);
-        child_pid = -1; // Reset child_pid after command execution
+        waitpid(pid, &status, 0);
     }
 }
 
-// Function to execute multiple commands separated by ";"
-void execute_commands(char *line) {
-    char *commands[MAX_ARGS];
-    split_commands(line, commands);
-    for (int i = 0; commands[i] != NULL; i++) {
-        char *args[MAX_ARGS];
-        parse_command(commands[i], args);
-        execute_command(args);
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Function to compare commands/sec of fork()+execvp() against posix_spawn,
+// with and without the command hash table, for a batch of trivial commands,
+// optionally with extra resident memory to stand in for a large shell process
+int run_spawn_benchmark(int argc, char *argv[]) {
+    int count = 10000;
+    long rss_mb = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--commands") == 0 && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rss") == 0 && i + 1 < argc) {
+            rss_mb = atol(argv[++i]);
+        } else {
+            printf("Usage: %s --bench [--commands N] [--rss MB]\n", argv[0]);
+            return 1;
+        }
+    }
+    char *ballast = NULL;
+    if (rss_mb > 0) {
+        ballast = malloc(rss_mb << 20);
+        if (ballast == NULL) {
+            perror("Unable to allocate memory");
+            return 1;
+        }
+        memset(ballast, 1, rss_mb << 20); // Touch every page so it is really resident
+    }
+
+    printf("Running \"true\" %d times, %ld MB of extra resident memory\n", count, rss_mb);
+    double start = now_seconds();
+    for (int i = 0; i < count; i++) {
+        char *args[] = {"true", NULL};
+        fork_command(args);
+    }
+    double fork_rate = count / (now_seconds() - start);
+
+    double spawn_rates[2];
+    for (use_hash = 0; use_hash <= 1; use_hash++) {
+        start = now_seconds();
+        for (int i = 0; i < count; i++) {
+            char line[] = "true";
+            execute_commands(line);
+        }
+        spawn_rates[use_hash] = count / (now_seconds() - start);
+    }
+    char path[PATH_MAX];
+    path_probes = 0;
+    search_path("true", path, sizeof(path));
+
+    printf("fork + execvp:          %.0f commands/sec\n", fork_rate);
+    printf("posix_spawnp:           %.0f commands/sec (%.2fx)\n", spawn_rates[0], spawn_rates[0] / fork_rate);
+    printf("posix_spawn, hashed:    %.0f commands/sec (%.2fx)\n", spawn_rates[1], spawn_rates[1] / fork_rate);
+    printf("PATH directories tried per command: %ld without the hash table, 0 with it\n", path_probes);
+    free(ballast);
+    return 0;
+}
+
+// Function to measure how many lines per second parse_line() handles for a
+// mix of simple commands, pipelines, quoting and conditionals
+int run_parse_benchmark() {
+    const char *lines[] = {
+        "ls -l",
+        "echo hello world; date; uptime",
+        "cat < input.txt | grep -v '^#' | sort -u | head -20 > out.txt",
+        "make -j8 && ./run_tests --verbose || echo \"tests failed: see log\"",
+        "find . -name \"*.c\" -newer build/stamp -print0 | xargs -0 grep -n 'TODO\\|FIXME' >> todo.txt &",
+        "cp a\\ file\\ with\\ spaces.txt 'another name.txt'; rm -f /tmp/x /tmp/y /tmp/z",
+    };
+    int count = sizeof(lines) / sizeof(lines[0]);
+    size_t bytes_per_round = 0;
+    for (int i = 0; i < count; i++) {
+        bytes_per_round += strlen(lines[i]);
+    }
+
+    ParsedLine parsed;
+    long rounds = 0, words = 0;
+    double start = now_seconds(), elapsed;
+    do {
+        for (int r = 0; r < 1000; r++, rounds++) {
+            for (int i = 0; i < count; i++) {
+                parse_line(lines[i], &parsed);
+                words += parsed.num_words; // Keeps the parse from being optimised away
+            }
+        }
+        elapsed = now_seconds() - start;
+    } while (elapsed < 1.0);
+
+    printf("Parsed %ld lines (%ld words) in %.3f s: %.0f lines/sec, %.1f MB/sec\n", rounds * count, words,
+           elapsed, rounds * count / elapsed, rounds * bytes_per_round / 1e6 / elapsed);
+    return 0;
+}
+
+// Saved history. Every command is appended to the history file as soon as
+// it is entered, with one O_APPEND write under a shared flock, so shells
+// running at the same time never mix up their lines. At startup the file
+// is mmap'd and split into lines in place; only the newest HISTORY_SIZE
+// are copied into readline for the arrow keys. Ctrl-R searches the whole
+// history for the text typed so far, newest first, and pressing it again
+// finds the next older match. The search uses a trigram index: each block
+// of HISTORY_BLOCK_LINES lines has a bitmap of the trigrams in it, so only
+// blocks holding every trigram of the query are scanned.
+#define HISTORY_FILE_NAME ".myshell_history"
+#define HISTORY_SIZE 10000          // Entries readline keeps for the arrow keys
+#define HISTORY_FILE_LINES 1000000  // Entries kept when the file is trimmed
+#define HISTORY_BLOCK_LINES 32      // Lines summarised by one trigram bitmap
+#define SIGNATURE_BITS 4096         // Bits in a trigram bitmap, a power of two
+
+typedef struct {
+    const char *text; // Not NUL terminated when it points into the mapped file
+    unsigned length;
+} HistoryLine;
+
+typedef struct {
+    uint64_t bits[SIGNATURE_BITS / 64];
+} HistorySignature;
+
+char history_path[PATH_MAX];
+char *history_map = NULL;
+size_t history_map_size = 0;
+HistoryLine *history_lines = NULL;
+long num_history_lines = 0, history_capacity = 0;
+HistorySignature *history_signatures = NULL;
+long indexed_lines = 0; // Lines already in history_signatures
+
+// Function to add a line to the in-memory history
+static void add_history_line(const char *text, unsigned length) {
+    if (num_history_lines == history_capacity) {
+        history_capacity = history_capacity ? history_capacity * 2 : 1024;
+        history_lines = realloc(history_lines, sizeof(HistoryLine) * history_capacity);
+        if (history_lines == NULL) {
+            perror("Unable to grow history");
+            exit(1);
+        }
+    }
+    history_lines[num_history_lines].text = text;
+    history_lines[num_history_lines].length = length;
+    num_history_lines++;
+}
+
+// Function to get the bitmap bit of the trigram starting at p
+static unsigned trigram_bit(const char *p) {
+    uint32_t h = ((uint32_t)(unsigned char)p[0] << 16) | ((uint32_t)(unsigned char)p[1] << 8) |
+                 (unsigned char)p[2];
+    return (h * 2654435761u) >> 20 & (SIGNATURE_BITS - 1);
+}
+
+// Function to bring the trigram index up to date with the history. It is
+// built on the first search rather than at startup.
+static void index_history() {
+    long blocks = (num_history_lines + HISTORY_BLOCK_LINES - 1) / HISTORY_BLOCK_LINES;
+    long indexed_blocks = (indexed_lines + HISTORY_BLOCK_LINES - 1) / HISTORY_BLOCK_LINES;
+    if (blocks > indexed_blocks) {
+        history_signatures = realloc(history_signatures, sizeof(HistorySignature) * blocks);
+        if (history_signatures == NULL) {
+            perror("Unable to grow history index");
+            exit(1);
+        }
+        memset(&history_signatures[indexed_blocks], 0, sizeof(HistorySignature) * (blocks - indexed_blocks));
+    }
+    for (; indexed_lines < num_history_lines; indexed_lines++) {
+        HistoryLine *line = &history_lines[indexed_lines];
+        HistorySignature *signature = &history_signatures[indexed_lines / HISTORY_BLOCK_LINES];
+        for (unsigned i = 0; i + 3 <= line->length; i++) {
+            unsigned bit = trigram_bit(line->text + i);
+            signature->bits[bit / 64] |= 1ull << (bit % 64);
+        }
+    }
+}
+
+// Function to find the newest line at or before line from that contains
+// query, checking every line. Returns its number, or -1.
+long find_history_linear(const char *query, long from) {
+    size_t length = strlen(query);
+    for (long i = from; i >= 0; i--) {
+        if (memmem(history_lines[i].text, history_lines[i].length, query, length) != NULL) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Function to find the newest line at or before line from that contains
+// query, skipping blocks that lack one of its trigrams. Returns its
+// number, or -1.
+long find_history(const char *query, long from) {
+    size_t length = strlen(query);
+    uint64_t wanted[SIGNATURE_BITS / 64] = {0};
+    if (length < 3) {
+        return find_history_linear(query, from);
+    }
+    index_history();
+    for (size_t i = 0; i + 3 <= length; i++) {
+        unsigned bit = trigram_bit(query + i);
+        wanted[bit / 64] |= 1ull << (bit % 64);
+    }
+    for (long block = from / HISTORY_BLOCK_LINES; block >= 0; block--) {
+        HistorySignature *signature = &history_signatures[block];
+        int possible = 1;
+        for (int w = 0; w < SIGNATURE_BITS / 64 && possible; w++) {
+            possible = (signature->bits[w] & wanted[w]) == wanted[w];
+        }
+        if (!possible) {
+            continue;
+        }
+        long first = block * HISTORY_BLOCK_LINES;
+        for (long i = from < first + HISTORY_BLOCK_LINES - 1 ? from : first + HISTORY_BLOCK_LINES - 1; i >= first; i--) {
+            if (memmem(history_lines[i].text, history_lines[i].length, query, length) != NULL) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+// Function to cut the history file down to its newest lines, from offset
+// keep on. New lines appended meanwhile by other shells are kept: they
+// wait on the lock, and find the file replaced when they get it.
+static void trim_history_file(off_t keep) {
+    char temp_path[PATH_MAX + 32], buffer[65536];
+    int fd = open(history_path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    flock(fd, LOCK_EX);
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", history_path, (int)getpid());
+    int out = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    ssize_t n = 0;
+    if (out >= 0) {
+        while ((n = pread(fd, buffer, sizeof(buffer), keep)) > 0 && write(out, buffer, n) == n) {
+            keep += n;
+        }
+        if (close(out) != 0 || n != 0 || rename(temp_path, history_path) != 0) {
+            unlink(temp_path);
+        }
+    }
+    close(fd); // Releases the lock
+}
+
+// Function to load the history file, creating nothing if it is missing
+void load_history() {
+    const char *file = getenv("MYSHELL_HISTFILE");
+    const char *home = getenv("HOME");
+    if (file != NULL) {
+        snprintf(history_path, sizeof(history_path), "%s", file);
+    } else {
+        snprintf(history_path, sizeof(history_path), "%s/%s", home ? home : ".", HISTORY_FILE_NAME);
+    }
+    stifle_history(HISTORY_SIZE);
+
+    int fd = open(history_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    history_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (history_map == MAP_FAILED) {
+        history_map = NULL;
+        return;
+    }
+    history_map_size = st.st_size;
+    madvise(history_map, history_map_size, MADV_SEQUENTIAL);
+    for (char *p = history_map, *end = history_map + history_map_size; p < end;) {
+        char *newline = memchr(p, '\n', end - p);
+        char *next = newline ? newline : end;
+        if (next > p) {
+            add_history_line(p, next - p);
+        }
+        p = next + 1;
+    }
+
+    char text[MAX_LINE + 1];
+    for (long i = num_history_lines > HISTORY_SIZE ? num_history_lines - HISTORY_SIZE : 0; i < num_history_lines; i++) {
+        unsigned length = history_lines[i].length < MAX_LINE ? history_lines[i].length : MAX_LINE;
+        memcpy(text, history_lines[i].text, length);
+        text[length] = '\0';
+        add_history(text);
+    }
+    if (num_history_lines > HISTORY_FILE_LINES + HISTORY_FILE_LINES / 4) {
+        trim_history_file(history_lines[num_history_lines - HISTORY_FILE_LINES].text - history_map);
+    }
+}
+
+// Function to add an entered line to the history and the history file
+void save_history_line(const char *line) {
+    size_t length = strlen(line);
+    char *copy = malloc(length + 2);
+    if (copy == NULL || strchr(line, '\n') != NULL) {
+        free(copy);
+        return;
+    }
+    add_history(line);
+    memcpy(copy, line, length);
+    copy[length] = '\n';
+    copy[length + 1] = '\0';
+    add_history_line(copy, length);
+
+    // A shell that trims the file replaces it, so check that the file we
+    // locked is still the one at history_path before writing to it
+    for (int attempt = 0; attempt < 2; attempt++) {
+        struct stat locked, current;
+        int fd = open(history_path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+        if (fd < 0) {
+            return;
+        }
+        flock(fd, LOCK_SH);
+        if (fstat(fd, &locked) == 0 && stat(history_path, &current) == 0 &&
+            locked.st_ino == current.st_ino && locked.st_dev == current.st_dev) {
+            if (write(fd, copy, length + 1) != (ssize_t)(length + 1)) {
+                perror("Unable to save history");
+            }
+            close(fd);
+            return;
+        }
+        close(fd);
+    }
+}
+
+// Function bound to Ctrl-R: replace the line with the newest history entry
+// containing what was typed. Pressing it again moves to older matches.
+int history_search_key(int count, int key) {
+    static char query[MAX_LINE + 1];
+    static long next = -1;
+    if (rl_last_func != history_search_key) {
+        snprintf(query, sizeof(query), "%s", rl_line_buffer);
+        next = num_history_lines - 1;
+    }
+    while (next >= 0) {
+        long found = find_history(query, next);
+        next = found - 1;
+        if (found < 0) {
+            break;
+        }
+        // Skip repeats of the entry already shown
+        HistoryLine *line = &history_lines[found];
+        if (line->length > MAX_LINE || (line->length == strlen(rl_line_buffer) &&
+                                        memcmp(line->text, rl_line_buffer, line->length) == 0)) {
+            continue;
+        }
+        char text[MAX_LINE + 1];
+        memcpy(text, line->text, line->length);
+        text[line->length] = '\0';
+        rl_replace_line(text, 0);
+        rl_point = rl_end;
+        return 0;
+    }
+    rl_ding();
+    return 0;
+}
+
+// Function to time loading and searching a synthetic history of N entries
+int run_history_benchmark(int argc, char *argv[]) {
+    long entries = 1000000;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--entries") == 0 && i + 1 < argc) {
+            entries = atol(argv[++i]);
+        } else {
+            printf("Usage: %s --bench-history [--entries N]\n", argv[0]);
+            return 1;
+        }
+    }
+    const char *templates[] = {
+        "git commit -m 'fix issue %d'", "cd ~/projects/service%d", "make -j%d && ./run_tests",
+        "grep -rn 'pattern%d' src/", "ssh build%d.example.com", "vim src/module%d.c",
+        "ls -la /var/log/app%d", "docker run --rm -it image:%d", "kill -9 %d", "python3 script%d.py --fast",
+    };
+    char path[] = "/tmp/history_benchXXXXXX";
+    int fd = mkstemp(path);
+    FILE *file = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (file == NULL) {
+        perror("Unable to create history file");
+        return 1;
+    }
+    unsigned seed = 12345;
+    for (long i = 0; i < entries; i++) {
+        seed = seed * 1103515245u + 12345u;
+        fprintf(file, templates[(seed >> 16) % 10], (int)((seed >> 4) % 50000));
+        fputc('\n', file);
+    }
+    fclose(file);
+    setenv("MYSHELL_HISTFILE", path, 1);
+
+    double start = now_seconds();
+    load_history();
+    double load_time = now_seconds() - start;
+    start = now_seconds();
+    index_history();
+    double index_time = now_seconds() - start;
+    printf("Loaded %ld entries (%.1f MB) in %.1f ms, indexed in %.1f ms\n", num_history_lines,
+           history_map_size / 1e6, load_time * 1e3, index_time * 1e3);
+
+    const char *queries[] = {"service4242", "issue 31337", "image:7", "module123.c", "no such command"};
+    printf("%-18s %12s %12s\n", "query", "indexed us", "linear us");
+    for (int q = 0; q < 5; q++) {
+        double times[2];
+        long found[2];
+        for (int linear = 0; linear < 2; linear++) {
+            int rounds = 0;
+            start = now_seconds();
+            do {
+                found[linear] = linear ? find_history_linear(queries[q], num_history_lines - 1)
+                                       : find_history(queries[q], num_history_lines - 1);
+                rounds++;
+            } while (now_seconds() - start < 0.2);
+            times[linear] = (now_seconds() - start) / rounds * 1e6;
+        }
+        printf("%-18s %12.1f %12.1f%s\n", queries[q], times[0], times[1], found[0] == found[1] ? "" : "  MISMATCH");
+    }
+    unlink(path);
+    return 0;
+}
+
+// Function called by readline with each line typed, or NULL at the end of input
+void handle_line(char *line) {
+    rl_callback_handler_remove(); // Give the terminal back while the command runs
+    at_prompt = 0;
+    if (line == NULL) {
+        printf("\n");
+        quit_shell = 1;
+        return;
     }
+    if (*line) {
+        save_history_line(line);
+        if (strcmp(line, "quit") == 0) {
+            quit_shell = 1;
+        } else {
+            execute_commands(line);
+            if (interrupted) {
+                printf("\n"); // Start the prompt after the ^C
+                interrupted = 0;
+            }
+        }
+    }
+    free(line);
+    if (!quit_shell) {
+        rl_callback_handler_install("Shell> ", handle_line);
+        at_prompt = 1;
+    }
+}
+
+// Function to read one line of a batch file without its newline. A line
+// too long for the buffer is reported and skipped up to its newline rather
+// than run in pieces. Returns 1 for a line, 0 for a skipped one, -1 at the end
+int read_batch_line(FILE *file, char *line, int size) {
+    if (!fgets(line, size, file)) {
+        return -1;
+    }
+    size_t length = strcspn(line, "\n");
+    if (line[length] == '\0' && length == (size_t)size - 1) {
+        int c = getc(file);
+        if (c != EOF && c != '\n') {
+            while (c != EOF && c != '\n') {
+                c = getc(file);
+            }
+            fprintf(stderr, "Line too long\n");
+            return 0;
+        }
+    }
+    line[length] = '\0';
+    return 1;
 }
 
 // Function to execute commands from a batch file
@@ -91,42 +1292,227 @@ void execute_batch_file(char *filename) {
     }
 
     char line[MAX_LINE];
-    while (fgets(line, sizeof(line), file)) {
-        line[strcspn(line, "\n")] = 0;
+    int result;
+    while (!interrupted && (result = read_batch_line(file, line, sizeof(line))) >= 0) {
+        if (result == 0) {
+            continue;
+        }
         printf("Batch command: %s\n", line); // Print the command before execution
         execute_commands(line);
     }
     fclose(file);
+    reap_jobs(1); // Let background jobs finish before the batch ends
+    if (interrupted) {
+        printf("Batch interrupted\n");
+    }
 }
 
-int main(int argc, char *argv[]) {
-    // Set up signal handlers
-    signal(SIGINT, exit_shell);
-    signal(SIGQUIT, end_execution);
+// Function to start the next foreground pipeline of a batch line, running
+// any builtins and background commands before it. Marks the line done when
+// nothing is left to run.
+void batch_line_advance(BatchLine *b) {
+    while (b->next_pipeline < b->parsed.num_pipelines) {
+        Pipeline *pipeline = &b->parsed.pipelines[b->next_pipeline++];
+        if (!should_run(pipeline, b->status)) {
+            continue;
+        }
+        b->running = start_command(pipeline, b->output, b->pids, &b->status);
+        b->num_pids = b->running;
+        if (b->running > 0) {
+            return;
+        }
+    }
+    b->done = 1;
+}
+
+// Function to print a finished line and its captured output, then free it
+void batch_line_print(BatchLine *b, int *failed) {
+    char buffer[8192];
+    size_t length;
+    printf("Batch command: %s\n", b->line);
+    fflush(b->output);
+    rewind(b->output);
+    while ((length = fread(buffer, 1, sizeof(buffer), b->output)) > 0) {
+        fwrite(buffer, 1, length, stdout);
+    }
+    fclose(b->output);
+    b->output = NULL;
+    if (b->status != 0) {
+        printf("Batch command failed with status %d: %s\n", b->status, b->line);
+        (*failed)++;
+    }
+}
 
+// Function to execute a batch file running up to max_jobs lines at once.
+// Each line still runs its own commands in order, with output captured to a
+// temporary file and printed in file order once the line and every line
+// before it are done. A line containing only "wait" is a barrier: later
+// lines start only after everything before it has finished.
+void execute_batch_parallel(char *filename, int max_jobs) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        perror("Unable to open batch file");
+        exit(EXIT_FAILURE);
+    }
+
+    // Lines that are running or waiting for earlier lines to be printed
+    int window = max_jobs * 4 > 64 ? max_jobs * 4 : 64;
+    BatchLine *lines = calloc(window, sizeof(BatchLine));
+    long started = 0, printed = 0;
+    int running = 0, failed = 0, barrier = 0, at_end = 0;
+    double start = now_seconds();
+
+    while (!at_end || printed < started) {
+        // Start lines while there is room and no barrier is holding them back
+        while (!at_end && running < max_jobs && started - printed < window && !(barrier && running > 0)) {
+            BatchLine *b = &lines[started % window];
+            if (barrier) {
+                reap_jobs(1); // Background jobs from before the barrier too
+                barrier = 0;
+            }
+            int result = read_batch_line(file, b->line, sizeof(b->line));
+            if (result < 0) {
+                at_end = 1;
+                break;
+            }
+            if (result == 0) {
+                continue;
+            }
+            char word[8];
+            if (sscanf(b->line, " %7s", word) == 1 && strcmp(word, "wait") == 0 &&
+                strspn(b->line, " \t") + 4 == strlen(b->line)) {
+                barrier = 1;
+                continue;
+            }
+            memset(b->pids, 0, sizeof(b->pids));
+            b->next_pipeline = 0;
+            b->status = 0;
+            b->done = 0;
+            b->output = tmpfile();
+            if (b->output == NULL) {
+                perror("Unable to capture output");
+                exit(EXIT_FAILURE);
+            }
+            fcntl(fileno(b->output), F_SETFD, FD_CLOEXEC); // Only this line's commands write to it
+            started++;
+            if (parse_line(b->line, &b->parsed) != 0) {
+                fprintf(b->output, "%s\n", b->parsed.error);
+                b->parsed.num_pipelines = 0;
+                b->status = 2; // Usage error, as in other shells
+            }
+            batch_line_advance(b);
+            running += !b->done;
+        }
+
+        // Print finished lines in file order
+        while (printed < started && lines[printed % window].done) {
+            batch_line_print(&lines[printed++ % window], &failed);
+        }
+        if (running == 0) {
+            continue;
+        }
+
+        // Wait for any process and move its line forward
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            perror("Wait failed");
+            exit(EXIT_FAILURE);
+        }
+        num_children--;
+        int owner = 0;
+        for (long i = printed; i < started && !owner; i++) {
+            BatchLine *b = &lines[i % window];
+            for (int j = 0; !b->done && j < b->num_pids; j++) {
+                if (b->pids[j] == pid) {
+                    owner = 1;
+                    if (j == b->num_pids - 1 && b->status == 0) {
+                        // The last stage decides the status, as in other shells
+                        b->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                    }
+                    if (--b->running == 0) {
+                        batch_line_advance(b);
+                        running -= b->done;
+                    }
+                }
+            }
+        }
+        if (!owner) {
+            job_process_done(pid);
+        }
+    }
+    fclose(file);
+    reap_jobs(1);
+    free(lines);
+    printf("Ran %ld batch commands with -j %d in %.3f s, %d failed\n", started, max_jobs, now_seconds() - start,
+           failed);
+}
+int main(int argc, char *argv[]) {
     // Initialize history feature
     using_history();
 
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        return run_spawn_benchmark(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-parse") == 0) {
+        return run_parse_benchmark();
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-history") == 0) {
+        return run_history_benchmark(argc, argv);
+    }
+
+    // Run a batch file with up to N lines at once
+    if (argc == 4 && strcmp(argv[1], "-j") == 0) {
+        int max_jobs = atoi(argv[2]);
+        if (max_jobs < 1) {
+            fprintf(stderr, "Usage: %s [-j N] [batch file]\n", argv[0]);
+            return 1;
+        }
+        execute_batch_parallel(argv[3], max_jobs);
+        return 0;
+    }
+
     // Check if a batch file is provided
     if (argc == 2) {
+        setup_signals();
         execute_batch_file(argv[1]);
         return 0;
     }
 
-    // Interactive mode
-    char *line;
-    while (1) {
-        line = readline("Shell> ");
-        if (line && *line) {
-            add_history(line);
-            if (strcmp(line, "quit") == 0) {
-                free(line);
-                break;
+    // Interactive mode: one loop waits for both input and signals, so
+    // finished background jobs are reported while the prompt is up.
+    // Readline is fed a character at a time through its callback interface.
+    setup_signals();
+    load_history();
+    rl_catch_signals = 0;
+    rl_bind_key('\022', history_search_key); // Ctrl-R
+    rl_callback_handler_install("Shell> ", handle_line);
+    at_prompt = 1;
+    while (!quit_shell) {
+        struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {signal_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            handle_signals();
+            if (!at_prompt) {
+                show_prompt();
             }
-            execute_commands(line);
-            free(line);
+            if (interrupted) {
+                // Drop the half-typed line, as other shells do
+                interrupted = 0;
+                rl_callback_sigcleanup();
+                rl_replace_line("", 0);
+                rl_crlf();
+                rl_on_new_line();
+                rl_redisplay();
+            }
+        }
+        if (fds[0].revents) {
+            rl_callback_read_char();
         }
     }
+    rl_callback_handler_remove();
     printf("Exiting Shell...\n");
     return 0;
 }
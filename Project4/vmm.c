@@ -9,40 +9,74 @@
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #define MAX_LINE 1024
 #define MAX_ARGS 64
-#define PAGE_SIZE 4096
+#define PAGE_OFFSET_BITS 12
+#define PAGE_SIZE (1 << PAGE_OFFSET_BITS)
 #define FRAME_COUNT 256
-#define VIRTUAL_MEMORY_SIZE (PAGE_SIZE * FRAME_COUNT)
+#define VIRTUAL_ADDRESS_BITS 39 // Three levels of 512 entries over 4 KB pages, as in Sv39
+#define VIRTUAL_MEMORY_SIZE (1ULL << VIRTUAL_ADDRESS_BITS)
+#define LEVEL_BITS 9 // Page number bits resolved by each page table level
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define MAX_PROCESSES 65536
+#define FRAME_WORDS ((FRAME_COUNT + 63) / 64) // Words in the free frame bitmap
+#define AGING_INTERVAL 16 // Accesses between shifts of the aging counters
+#define MAX_TLB_ENTRIES 65536
+#define TLB_LOOKUP_COST 1     // Modelled cycles to search the TLB
+#define PAGE_WALK_COST 100    // Modelled cycles to read one level of a page table
+#define PAGE_TABLE_LEVELS 3   // Levels read by a page table walk
 
 // Define Page Table Entry and Page Table Structures
+// Page tables are radix trees of PAGE_TABLE_LEVELS levels. Each level
+// resolves LEVEL_BITS of the page number, and the last level holds the
+// page table entries. Nodes are allocated the first time a page under them
+// is mapped and freed when their last page is unmapped, so a process costs
+// memory for the pages it has resident, not for the size of its address
+// space.
 typedef struct {
     int frame_number;
     bool valid;
 } PageTableEntry;
 
-typedef struct {
-    PageTableEntry entries[FRAME_COUNT];
-} PageTable;
+typedef struct PageTableNode {
+    int used; // Valid entries, or child nodes below a directory level
+    union {
+        struct PageTableNode *children[LEVEL_SIZE]; // Directory levels
+        PageTableEntry entries[LEVEL_SIZE];         // Last level
+    };
+} PageTableNode;
 
 // Define Process Control Block and Frame Structures
 typedef struct {
     int pid;
-    PageTable page_table;
+    int resident_pages;
+    PageTableNode *page_directory; // NULL while the process has nothing mapped
 } ProcessControlBlock;
 
+// physical_memory[] doubles as the reverse map from a frame to the
+// process and page in it, so evicting or freeing a frame never searches
 typedef struct {
     int process_id;
-    int page_number;
+    long page_number;
     bool dirty;
     bool valid;
 } Frame;
 
 // Initialize Memory and Process Structures
 Frame physical_memory[FRAME_COUNT];
-ProcessControlBlock processes[FRAME_COUNT];
-int next_free_frame = 0;
+ProcessControlBlock **processes = NULL; // Indexed by pid, grown as processes appear
+int process_capacity = 0;
+int num_processes = 0;
+long page_table_bytes = 0;
+long peak_page_table_bytes = 0;
+uint64_t free_frames[FRAME_WORDS]; // Bit set for every free frame
+bool verbose = true;               // Report every access, off while benchmarking
 pid_t child_pid = -1;
 
 // Signal Handler to Exit Shell
@@ -59,62 +93,1085 @@ void end_execution(int sig) {
     }
 }
 
-// Split Input into Commands
-void split_commands(char *input, char **commands) {
-    char *token = strtok(input, ";");
-    int i = 0;
-    while (token != NULL && i < MAX_ARGS - 1) {
-        commands[i++] = token;
-        token = strtok(NULL, ";");
+// Tokenizer shared by the shells. parse_line() reads the line once and
+// writes the unquoted words into the ParsedLine, which holds every word,
+// command and pipeline of the line, so nothing is allocated per token and
+// no state is kept between calls; it is safe to call from any thread.
+// Understands '...' and "..." quoting, backslash escapes, ;, &, |, &&, ||,
+// <, > and >>. Input that does not fit is an error, never cut short.
+#define MAX_WORDS 256
+#define MAX_STAGES 64
+#define MAX_PIPELINES 64
+
+// When a pipeline runs, based on the status of the one before it
+typedef enum {
+    RUN_ALWAYS,     // First pipeline, or after ";" or "&"
+    RUN_IF_SUCCESS, // After "&&"
+    RUN_IF_FAILURE  // After "||"
+} RunCondition;
+
+// One stage of a pipeline with its redirections
+typedef struct {
+    char **args;  // NULL-terminated, points into the line's word list
+    int argc;
+    char *input;  // File for "<", or NULL
+    char *output; // File for ">" or ">>", or NULL
+    int append;   // Set for ">>"
+} Command;
+
+typedef struct {
+    Command *stages;
+    int num_stages;
+    int background; // Ended by "&"
+    RunCondition condition;
+} Pipeline;
+
+typedef struct {
+    char text[MAX_LINE + 1];  // Unquoted words, each NUL-terminated
+    char *words[MAX_WORDS];   // Argument lists of every command, each ending in NULL
+    Command commands[MAX_STAGES];
+    Pipeline pipelines[MAX_PIPELINES];
+    int num_words;
+    int num_commands;
+    int num_pipelines;
+    const char *error;        // Why parse_line() failed
+} ParsedLine;
+
+// Character classes for the tokenizer's inner loops
+enum { CHAR_WORD, CHAR_SPACE, CHAR_OPERATOR, CHAR_QUOTE };
+static const unsigned char char_class[256] = {
+    ['\0'] = CHAR_OPERATOR, [';'] = CHAR_OPERATOR, ['&'] = CHAR_OPERATOR, ['|'] = CHAR_OPERATOR,
+    ['<'] = CHAR_OPERATOR, ['>'] = CHAR_OPERATOR, [' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\n'] = CHAR_SPACE,
+    ['\''] = CHAR_QUOTE, ['"'] = CHAR_QUOTE, ['\\'] = CHAR_QUOTE,
+};
+
+// Function to start a command, and a pipeline for it if none is open
+static Command *begin_command(ParsedLine *parsed, Pipeline **pipeline, RunCondition condition) {
+    if (parsed->num_commands == MAX_STAGES || (*pipeline == NULL && parsed->num_pipelines == MAX_PIPELINES)) {
+        parsed->error = "Too many commands on one line";
+        return NULL;
+    }
+    if (*pipeline == NULL) {
+        *pipeline = &parsed->pipelines[parsed->num_pipelines++];
+        (*pipeline)->stages = &parsed->commands[parsed->num_commands];
+        (*pipeline)->num_stages = 0;
+        (*pipeline)->background = 0;
+        (*pipeline)->condition = condition;
+    }
+    Command *command = &parsed->commands[parsed->num_commands++];
+    (*pipeline)->num_stages++;
+    command->args = &parsed->words[parsed->num_words];
+    command->argc = 0;
+    command->input = command->output = NULL;
+    command->append = 0;
+    return command;
+}
+
+// Function to split a line into pipelines, commands and words.
+// Returns 0 on success, or -1 with parsed->error set.
+int parse_line(const char *line, ParsedLine *parsed) {
+    const char *read = line;
+    char *write = parsed->text;
+    Pipeline *pipeline = NULL; // Pipeline being filled
+    Command *command = NULL;   // Command being filled
+    char **target = NULL;      // Redirection waiting for its file name
+    RunCondition condition = RUN_ALWAYS;
+    int need_command = 0;      // Set after "|", "&&" and "||"
+
+    parsed->num_words = parsed->num_commands = parsed->num_pipelines = 0;
+    parsed->error = NULL;
+    if (strlen(line) >= MAX_LINE) {
+        parsed->error = "Line too long";
+        return -1;
+    }
+
+    for (;;) {
+        while (char_class[(unsigned char)*read] == CHAR_SPACE) {
+            read++;
+        }
+        char c = *read;
+        if (c == '\0' || c == ';' || c == '&' || c == '|') {
+            int two = c != '\0' && c != ';' && read[1] == c; // "&&" or "||"
+            if (target != NULL) {
+                parsed->error = "Missing file name for redirection";
+                return -1;
+            }
+            if (command != NULL) {
+                if (command->argc == 0) {
+                    parsed->error = "Syntax error: missing command";
+                    return -1;
+                }
+                parsed->words[parsed->num_words++] = NULL; // Room was kept when the words were added
+                command = NULL;
+            } else if (need_command || c == '&' || c == '|') {
+                // Only ";" may follow nothing; "|", "&", "&&" and "||" need a command before them
+                parsed->error = "Syntax error: missing command";
+                return -1;
+            }
+            if (c == '\0') {
+                break;
+            }
+            read += two ? 2 : 1;
+            need_command = c == '|' || two;
+            if (c == '|' && !two) {
+                continue; // Next stage of the same pipeline
+            }
+            if (pipeline != NULL) {
+                pipeline->background = c == '&' && !two;
+            }
+            pipeline = NULL;
+            condition = !two ? RUN_ALWAYS : c == '&' ? RUN_IF_SUCCESS : RUN_IF_FAILURE;
+            continue;
+        }
+        if (command == NULL && (command = begin_command(parsed, &pipeline, condition)) == NULL) {
+            return -1;
+        }
+        if (c == '<' || c == '>') {
+            if (target != NULL) {
+                parsed->error = "Missing file name for redirection";
+                return -1;
+            }
+            if (c == '<') {
+                target = &command->input;
+            } else {
+                target = &command->output;
+                command->append = read[1] == '>';
+                read += command->append;
+            }
+            read++;
+            continue;
+        }
+
+        // A word: runs until unquoted whitespace or an operator
+        char *word = write;
+        for (;;) {
+            unsigned char kind = char_class[(unsigned char)*read];
+            if (kind == CHAR_WORD) {
+                *write++ = *read++;
+                continue;
+            }
+            if (kind != CHAR_QUOTE) {
+                break;
+            }
+            if (*read == '\'') {
+                const char *end = strchr(read + 1, '\'');
+                if (end == NULL) {
+                    parsed->error = "Unterminated quote";
+                    return -1;
+                }
+                memcpy(write, read + 1, end - read - 1);
+                write += end - read - 1;
+                read = end + 1;
+            } else if (*read == '"') {
+                for (read++; *read != '"'; read++) {
+                    if (*read == '\0') {
+                        parsed->error = "Unterminated quote";
+                        return -1;
+                    }
+                    if (*read == '\\' && read[1] != '\0' && strchr("\"\\$`", read[1])) {
+                        read++;
+                    }
+                    *write++ = *read;
+                }
+                read++;
+            } else if (read[1] != '\0') {
+                *write++ = read[1]; // Backslash escape
+                read += 2;
+            } else {
+                *write++ = *read++; // A backslash at the very end stays as it is
+            }
+        }
+        *write++ = '\0';
+        if (target != NULL) {
+            *target = word;
+            target = NULL;
+            continue;
+        }
+        if (parsed->num_words >= MAX_WORDS - 1) {
+            parsed->error = "Too many words on one line";
+            return -1;
+        }
+        parsed->words[parsed->num_words++] = word;
+        command->argc++;
+        need_command = 0;
+    }
+    return 0;
+}
+
+// Builtin commands. Each part of the program registers its own table of
+// builtins with register_builtins(), so adding one never means editing the
+// command handler. Names are placed with a perfect hash: registration
+// searches for a seed that gives every name a slot of its own, so finding
+// a builtin costs one hash and one strcmp however many there are. Entries
+// describe their arguments, which are checked before the builtin runs.
+#define MAX_BUILTINS 64
+#define BUILTIN_SLOTS 256 // Perfect hash table size, a power of two
+#define MAX_VARIANTS 4    // Entries that can share a name, told apart by their flag
+
+typedef void (*BuiltinFunction)(char **args);
+
+typedef struct {
+    const char *name;
+    const char *flag;  // Option that selects this variant, such as "-d", or NULL
+    const char *types; // One letter per argument: 's' for a string, 'n' for a number
+    int min_args;      // Arguments that can not be left out; strlen(types) is the most allowed
+    const char *usage;
+    BuiltinFunction run;
+} Builtin;
+
+// Every variant of one builtin name
+typedef struct {
+    const char *name;
+    const Builtin *variants[MAX_VARIANTS];
+    int num_variants;
+} BuiltinSlot;
+
+const Builtin *builtins[MAX_BUILTINS];
+int num_builtins = 0;
+BuiltinSlot builtin_slots[BUILTIN_SLOTS];
+unsigned builtin_seed = 0;
+
+// Function to hash a builtin name (seeded FNV-1a) to its slot
+static unsigned builtin_hash(unsigned seed, const char *name) {
+    unsigned h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    h ^= h >> 16;
+    return h & (BUILTIN_SLOTS - 1);
+}
+
+// Function to find a seed that gives every registered name its own slot
+// and fill the slots with it. Returns -1 if there is none.
+static int build_builtin_slots() {
+    for (unsigned seed = 1; seed < 100000; seed++) {
+        int ok = 1;
+        memset(builtin_slots, 0, sizeof(builtin_slots));
+        for (int i = 0; i < num_builtins; i++) {
+            BuiltinSlot *slot = &builtin_slots[builtin_hash(seed, builtins[i]->name)];
+            if (slot->name == NULL) {
+                slot->name = builtins[i]->name;
+            } else if (strcmp(slot->name, builtins[i]->name) != 0) {
+                ok = 0; // Two names collide, try the next seed
+                break;
+            }
+            slot->variants[slot->num_variants++] = builtins[i];
+        }
+        if (ok) {
+            builtin_seed = seed;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Function to add a table of builtins and rebuild the perfect hash
+void register_builtins(const Builtin *table, int count) {
+    for (int i = 0; i < count; i++) {
+        int variants = 0;
+        for (int j = 0; j < num_builtins; j++) {
+            variants += strcmp(builtins[j]->name, table[i].name) == 0;
+        }
+        if (num_builtins == MAX_BUILTINS || variants == MAX_VARIANTS) {
+            fprintf(stderr, "Too many builtins, %s not added\n", table[i].name);
+            continue;
+        }
+        builtins[num_builtins++] = &table[i];
+    }
+    if (build_builtin_slots() != 0) {
+        fprintf(stderr, "Unable to build the builtin table\n");
+        exit(1);
+    }
+}
+
+// Function to find the builtin a command names, picking the variant whose
+// flag is its first argument. Returns NULL if it is not a builtin.
+const Builtin *find_builtin(Command *command) {
+    BuiltinSlot *slot = &builtin_slots[builtin_hash(builtin_seed, command->args[0])];
+    const Builtin *plain = NULL;
+    if (slot->name == NULL || strcmp(slot->name, command->args[0]) != 0) {
+        return NULL;
+    }
+    for (int i = 0; i < slot->num_variants; i++) {
+        const Builtin *builtin = slot->variants[i];
+        if (builtin->flag == NULL) {
+            plain = builtin;
+        } else if (command->argc > 1 && strcmp(command->args[1], builtin->flag) == 0) {
+            return builtin;
+        }
+    }
+    return plain != NULL ? plain : slot->variants[0];
+}
+
+// Function to check a command's arguments against its builtin and run it.
+// Returns 0, or 2 after printing the usage when the arguments do not fit.
+int run_builtin(const Builtin *builtin, Command *command) {
+    int first = builtin->flag != NULL ? 2 : 1;
+    int count = command->argc - first;
+    int ok = count >= builtin->min_args && count <= (int)strlen(builtin->types) &&
+             (builtin->flag == NULL || strcmp(command->args[1], builtin->flag) == 0);
+    for (int i = 0; ok && i < count; i++) {
+        char *end;
+        if (builtin->types[i] == 'n') {
+            strtol(command->args[first + i], &end, 10);
+            ok = end != command->args[first + i] && *end == '\0';
+        }
+    }
+    if (!ok) {
+        printf("Usage: %s\n", builtin->usage);
+        return 2;
+    }
+    builtin->run(command->args + first);
+    return 0;
+}
+
+// Find a Process by pid, Creating it if Asked. Returns NULL if there is
+// no such process or the pid is out of range.
+ProcessControlBlock *find_process(int process_id, bool create) {
+    if (process_id < 0 || process_id >= MAX_PROCESSES) {
+        return NULL;
+    }
+    if (process_id < process_capacity && processes[process_id] != NULL) {
+        return processes[process_id];
+    }
+    if (!create) {
+        return NULL;
+    }
+    if (process_id >= process_capacity) {
+        int capacity = process_capacity > 0 ? process_capacity : 64;
+        while (capacity <= process_id) {
+            capacity *= 2;
+        }
+        ProcessControlBlock **grown = realloc(processes, capacity * sizeof(*processes));
+        if (grown == NULL) {
+            perror("Unable to grow the process table");
+            exit(1);
+        }
+        memset(grown + process_capacity, 0, (capacity - process_capacity) * sizeof(*grown));
+        processes = grown;
+        process_capacity = capacity;
+    }
+    ProcessControlBlock *process = calloc(1, sizeof(*process));
+    if (process == NULL) {
+        perror("Unable to create a process");
+        exit(1);
+    }
+    process->pid = process_id;
+    processes[process_id] = process;
+    num_processes++;
+    return process;
+}
+
+// Get the Index into a Page Table Level for a Page Number
+static int level_index(long page_number, int level) {
+    return (page_number >> ((PAGE_TABLE_LEVELS - 1 - level) * LEVEL_BITS)) & (LEVEL_SIZE - 1);
+}
+
+static PageTableNode *alloc_table_node() {
+    PageTableNode *node = calloc(1, sizeof(*node));
+    if (node == NULL) {
+        perror("Unable to allocate a page table");
+        exit(1);
+    }
+    page_table_bytes += sizeof(*node);
+    if (page_table_bytes > peak_page_table_bytes) {
+        peak_page_table_bytes = page_table_bytes;
+    }
+    return node;
+}
+
+static void free_table_node(PageTableNode *node) {
+    free(node);
+    page_table_bytes -= sizeof(*node);
+}
+
+// Walk a Process's Page Tables to the Entry for a Page. Returns NULL if
+// no page table covers the page.
+PageTableEntry *find_page_entry(ProcessControlBlock *process, long page_number) {
+    PageTableNode *node = process->page_directory;
+    for (int level = 0; node != NULL && level < PAGE_TABLE_LEVELS - 1; level++) {
+        node = node->children[level_index(page_number, level)];
+    }
+    return node != NULL ? &node->entries[level_index(page_number, PAGE_TABLE_LEVELS - 1)] : NULL;
+}
+
+// Map a Page to a Frame, Allocating the Page Tables on the Way
+void map_page(ProcessControlBlock *process, long page_number, int frame_number) {
+    PageTableNode **link = &process->page_directory, *node = NULL;
+    for (int level = 0; level < PAGE_TABLE_LEVELS; level++) {
+        if (*link == NULL) {
+            *link = alloc_table_node();
+            if (node != NULL) {
+                node->used++;
+            }
+        }
+        node = *link;
+        if (level < PAGE_TABLE_LEVELS - 1) {
+            link = &node->children[level_index(page_number, level)];
+        }
+    }
+    PageTableEntry *entry = &node->entries[level_index(page_number, PAGE_TABLE_LEVELS - 1)];
+    entry->frame_number = frame_number;
+    entry->valid = true;
+    node->used++;
+    process->resident_pages++;
+}
+
+// Unmap a Page, Freeing the Page Tables it Leaves Empty
+void unmap_page(ProcessControlBlock *process, long page_number) {
+    PageTableNode *path[PAGE_TABLE_LEVELS];
+    PageTableNode *node = process->page_directory;
+    for (int level = 0; level < PAGE_TABLE_LEVELS; level++) {
+        if (node == NULL) {
+            return;
+        }
+        path[level] = node;
+        if (level < PAGE_TABLE_LEVELS - 1) {
+            node = node->children[level_index(page_number, level)];
+        }
+    }
+    PageTableEntry *entry = &node->entries[level_index(page_number, PAGE_TABLE_LEVELS - 1)];
+    if (!entry->valid) {
+        return;
+    }
+    entry->valid = false;
+    process->resident_pages--;
+    for (int level = PAGE_TABLE_LEVELS - 1; level >= 0 && --path[level]->used == 0; level--) {
+        free_table_node(path[level]);
+        if (level > 0) {
+            path[level - 1]->children[level_index(page_number, level - 1)] = NULL;
+        } else {
+            process->page_directory = NULL;
+        }
+    }
+}
+
+// Page Replacement Policies
+// When every frame is in use, a page fault evicts a page chosen by the
+// policy picked with --policy. Each policy is told about every hit, load
+// and free so it can keep its own order, and victim() takes the frame it
+// picks out of that order before returning it.
+typedef struct {
+    const char *name;
+    void (*init)(void);
+    void (*hit)(int frame_number);
+    void (*loaded)(int frame_number, uint64_t key); // key names the page, see page_key()
+    int (*victim)(uint64_t key);                    // Frame to evict so the page key can be loaded
+    void (*freed)(int frame_number);
+} ReplacementPolicy;
+
+// Paging Statistics for show_stats
+typedef struct {
+    long accesses;
+    long hits;
+    long faults;
+    long evictions;
+    long writebacks;
+    long invalid;          // Accesses outside the address space
+    long tlb_hits;
+    long walks;            // Page table walks after TLB misses
+    long context_switches; // Accesses by a different process than the one before
+    long tlb_flushes;
+    double victim_seconds; // Time spent choosing victims
+} PagingStats;
+
+int num_frames = FRAME_COUNT; // Frames in use, set with --frames
+PagingStats stats;
+
+// Get a Number for a Page that is Unique Across Processes
+static uint64_t page_key(int process_id, long page_number) {
+    return (uint64_t)process_id << (VIRTUAL_ADDRESS_BITS - PAGE_OFFSET_BITS) | page_number;
+}
+
+// Get the Time in Seconds
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Doubly Linked Lists Threaded Through Arrays, Newest at the Head
+typedef struct {
+    int head;
+    int tail;
+    int size;
+} List;
+
+static void list_init(List *list) {
+    list->head = list->tail = -1;
+    list->size = 0;
+}
+
+static void list_push(List *list, int *prev, int *next, int node) {
+    prev[node] = -1;
+    next[node] = list->head;
+    if (list->head != -1) {
+        prev[list->head] = node;
+    } else {
+        list->tail = node;
+    }
+    list->head = node;
+    list->size++;
+}
+
+static void list_remove(List *list, int *prev, int *next, int node) {
+    if (prev[node] != -1) {
+        next[prev[node]] = next[node];
+    } else {
+        list->head = next[node];
+    }
+    if (next[node] != -1) {
+        prev[next[node]] = prev[node];
+    } else {
+        list->tail = prev[node];
+    }
+    list->size--;
+}
+
+int frame_prev[FRAME_COUNT];
+int frame_next[FRAME_COUNT];
+
+// FIFO: Evict the Page that was Loaded First
+List fifo_list;
+
+static void fifo_init() {
+    list_init(&fifo_list);
+}
+
+static void fifo_hit(int frame_number) {
+}
+
+static void fifo_loaded(int frame_number, uint64_t key) {
+    list_push(&fifo_list, frame_prev, frame_next, frame_number);
+}
+
+static int fifo_victim(uint64_t key) {
+    int frame_number = fifo_list.tail;
+    list_remove(&fifo_list, frame_prev, frame_next, frame_number);
+    return frame_number;
+}
+
+static void fifo_freed(int frame_number) {
+    list_remove(&fifo_list, frame_prev, frame_next, frame_number);
+}
+
+// Clock (Second Chance): Sweep the Frames, Evicting the First One that
+// has not been Referenced Since the Hand Last Passed It
+bool referenced[FRAME_COUNT]; // Reference bits, also used by aging
+int clock_hand = 0;
+
+static void clock_init() {
+    memset(referenced, 0, sizeof(referenced));
+    clock_hand = 0;
+}
+
+static void clock_hit(int frame_number) {
+    referenced[frame_number] = true;
+}
+
+static void clock_loaded(int frame_number, uint64_t key) {
+    referenced[frame_number] = true;
+}
+
+static int clock_victim(uint64_t key) {
+    for (;;) {
+        int frame_number = clock_hand;
+        clock_hand = (clock_hand + 1) % num_frames;
+        if (!physical_memory[frame_number].valid) {
+            continue;
+        }
+        if (!referenced[frame_number]) {
+            return frame_number;
+        }
+        referenced[frame_number] = false;
+    }
+}
+
+static void clock_freed(int frame_number) {
+    referenced[frame_number] = false;
+}
+
+// Aging (LRU Approximation): Every AGING_INTERVAL Accesses, Shift Each
+// Frame's Reference Bit into the Top of an 8-bit Counter, and Evict the
+// Frame with the Smallest Counter
+unsigned char age[FRAME_COUNT];
+long aging_ticks = 0;
+
+static void aging_tick() {
+    if (++aging_ticks % AGING_INTERVAL != 0) {
+        return;
+    }
+    for (int i = 0; i < num_frames; i++) {
+        age[i] = (age[i] >> 1) | (referenced[i] ? 0x80 : 0);
+        referenced[i] = false;
+    }
+}
+
+static void aging_init() {
+    memset(referenced, 0, sizeof(referenced));
+    memset(age, 0, sizeof(age));
+    aging_ticks = 0;
+}
+
+static void aging_hit(int frame_number) {
+    referenced[frame_number] = true;
+    aging_tick();
+}
+
+static void aging_loaded(int frame_number, uint64_t key) {
+    age[frame_number] = 0;
+    referenced[frame_number] = true;
+    aging_tick();
+}
+
+static int aging_victim(uint64_t key) {
+    int victim = -1, lowest = 0;
+    for (int i = 0; i < num_frames; i++) {
+        // Count a pending reference as if the next shift had happened
+        int value = (age[i] >> 1) | (referenced[i] ? 0x80 : 0);
+        if (physical_memory[i].valid && (victim == -1 || value < lowest)) {
+            victim = i;
+            lowest = value;
+        }
+    }
+    return victim;
+}
+
+static void aging_freed(int frame_number) {
+    referenced[frame_number] = false;
+}
+
+// ARC (Adaptive Replacement Cache): T1 holds pages used once and T2 pages
+// used again, while the ghost lists B1 and B2 remember the keys recently
+// evicted from each. A fault on a ghost grows the target size p of the
+// list it came from, so the split between recency and frequency follows
+// the workload.
+#define GHOST_COUNT (2 * FRAME_COUNT + 1) // Ghosts are trimmed after each load
+#define NO_PAGE UINT64_MAX
+#define GHOST_BUCKET_BITS 9               // Hash table of 512 buckets
+
+List arc_t1, arc_t2, arc_b1, arc_b2;
+bool arc_in_t2[FRAME_COUNT];
+int arc_p = 0;
+uint64_t arc_adapted_key = NO_PAGE; // Page whose ghost hit already adapted p
+uint64_t ghost_key[GHOST_COUNT];
+bool ghost_in_b2[GHOST_COUNT];
+int ghost_prev[GHOST_COUNT];
+int ghost_next[GHOST_COUNT];
+int ghost_chain[GHOST_COUNT]; // Next ghost in the same hash bucket
+int ghost_buckets[1 << GHOST_BUCKET_BITS];
+int ghost_free[GHOST_COUNT];
+int num_ghost_free = 0;
+
+// Hash a Page Key (Fibonacci hashing) to its Ghost Bucket
+static int ghost_bucket(uint64_t key) {
+    return (key * 0x9e3779b97f4a7c15ULL) >> (64 - GHOST_BUCKET_BITS);
+}
+
+static int ghost_find(uint64_t key) {
+    int node = ghost_buckets[ghost_bucket(key)];
+    while (node != -1 && ghost_key[node] != key) {
+        node = ghost_chain[node];
+    }
+    return node;
+}
+
+static void ghost_drop(int node) {
+    int *link = &ghost_buckets[ghost_bucket(ghost_key[node])];
+    while (*link != node) {
+        link = &ghost_chain[*link];
+    }
+    *link = ghost_chain[node];
+    list_remove(ghost_in_b2[node] ? &arc_b2 : &arc_b1, ghost_prev, ghost_next, node);
+    ghost_free[num_ghost_free++] = node;
+}
+
+static void ghost_add(bool in_b2, uint64_t key) {
+    int bucket = ghost_bucket(key);
+    int node = ghost_free[--num_ghost_free];
+    ghost_key[node] = key;
+    ghost_in_b2[node] = in_b2;
+    ghost_chain[node] = ghost_buckets[bucket];
+    ghost_buckets[bucket] = node;
+    list_push(in_b2 ? &arc_b2 : &arc_b1, ghost_prev, ghost_next, node);
+}
+
+// Move p Toward the List whose Ghost the Faulting Page Was Found In
+static void arc_adapt(uint64_t key) {
+    int node = ghost_find(key);
+    if (node == -1 || arc_adapted_key == key) {
+        return;
+    }
+    if (!ghost_in_b2[node]) {
+        int delta = arc_b2.size > arc_b1.size ? arc_b2.size / arc_b1.size : 1;
+        arc_p = arc_p + delta < num_frames ? arc_p + delta : num_frames;
+    } else {
+        int delta = arc_b1.size > arc_b2.size ? arc_b1.size / arc_b2.size : 1;
+        arc_p = arc_p - delta > 0 ? arc_p - delta : 0;
+    }
+    arc_adapted_key = key;
+}
+
+static void arc_init() {
+    list_init(&arc_t1);
+    list_init(&arc_t2);
+    list_init(&arc_b1);
+    list_init(&arc_b2);
+    arc_p = 0;
+    arc_adapted_key = NO_PAGE;
+    memset(ghost_buckets, -1, sizeof(ghost_buckets));
+    for (num_ghost_free = 0; num_ghost_free < GHOST_COUNT; num_ghost_free++) {
+        ghost_free[num_ghost_free] = num_ghost_free;
+    }
+}
+
+static void arc_hit(int frame_number) {
+    list_remove(arc_in_t2[frame_number] ? &arc_t2 : &arc_t1, frame_prev, frame_next, frame_number);
+    list_push(&arc_t2, frame_prev, frame_next, frame_number);
+    arc_in_t2[frame_number] = true;
+}
+
+static int arc_victim(uint64_t key) {
+    arc_adapt(key);
+    int node = ghost_find(key);
+    bool from_t1 = arc_t1.size > 0 &&
+                   (arc_t1.size > arc_p || arc_t2.size == 0 ||
+                    (node != -1 && ghost_in_b2[node] && arc_t1.size == arc_p));
+    int frame_number = from_t1 ? arc_t1.tail : arc_t2.tail;
+    Frame *frame = &physical_memory[frame_number];
+    list_remove(from_t1 ? &arc_t1 : &arc_t2, frame_prev, frame_next, frame_number);
+    ghost_add(!from_t1, page_key(frame->process_id, frame->page_number));
+    return frame_number;
+}
+
+static void arc_loaded(int frame_number, uint64_t key) {
+    int node = ghost_find(key);
+    if (node != -1) {
+        arc_adapt(key); // Not done yet if a free frame was used
+        ghost_drop(node);
+    }
+    list_push(node != -1 ? &arc_t2 : &arc_t1, frame_prev, frame_next, frame_number);
+    arc_in_t2[frame_number] = node != -1;
+    arc_adapted_key = NO_PAGE;
+    // Keep |T1| + |B1| <= c and everything remembered <= 2c
+    while (arc_t1.size + arc_b1.size > num_frames && arc_b1.size > 0) {
+        ghost_drop(arc_b1.tail);
+    }
+    while (arc_t1.size + arc_t2.size + arc_b1.size + arc_b2.size > 2 * num_frames && arc_b2.size > 0) {
+        ghost_drop(arc_b2.tail);
+    }
+}
+
+static void arc_freed(int frame_number) {
+    list_remove(arc_in_t2[frame_number] ? &arc_t2 : &arc_t1, frame_prev, frame_next, frame_number);
+}
+
+ReplacementPolicy policies[] = {
+    {"fifo", fifo_init, fifo_hit, fifo_loaded, fifo_victim, fifo_freed},
+    {"clock", clock_init, clock_hit, clock_loaded, clock_victim, clock_freed},
+    {"aging", aging_init, aging_hit, aging_loaded, aging_victim, aging_freed},
+    {"arc", arc_init, arc_hit, arc_loaded, arc_victim, arc_freed},
+};
+ReplacementPolicy *policy = &policies[0];
+
+// Select a Replacement Policy by Name. Returns -1 if there is none.
+int select_policy(const char *name) {
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcmp(policies[i].name, name) == 0) {
+            policy = &policies[i];
+            return 0;
+        }
     }
-    commands[i] = NULL;
+    return -1;
 }
 
-// Parse Command into Arguments
-void parse_command(char *cmd, char **args) {
-    char *token = strtok(cmd, " \n");
-    int i = 0;
-    while (token != NULL && i < MAX_ARGS - 1) {
-        args[i++] = token;
-        token = strtok(NULL, " \n");
+// Translation Lookaside Buffer
+// A set-associative cache of recent translations in front of the page
+// tables. Entries are tagged with the process id as an address space id,
+// so a context switch does not have to flush the TLB. --tlb-flush flushes
+// it anyway, to compare with a TLB that has no ASIDs.
+typedef enum { TLB_LRU, TLB_FIFO, TLB_RANDOM } TlbPolicy;
+
+typedef struct {
+    bool valid;
+    int asid;
+    long page_number;
+    int frame_number;
+    long stamp; // Last use under lru, time filled under fifo
+} TlbEntry;
+
+TlbEntry *tlb = NULL;  // NULL when the TLB is turned off with --tlb-entries 0
+int tlb_entries = 64;
+int tlb_ways = 4;
+int tlb_sets = 0;      // A power of two, so a page's set is found with a mask
+TlbPolicy tlb_policy = TLB_LRU;
+const char *tlb_policy_names[] = {"lru", "fifo", "random"};
+bool tlb_flush_on_switch = false;
+long tlb_clock = 0;
+int last_process = -1; // Process of the last access, to notice context switches
+
+// Allocate the TLB. Returns -1 if the size and associativity do not fit.
+int init_tlb() {
+    int sets = tlb_ways > 0 ? tlb_entries / tlb_ways : 0;
+    if (tlb_entries < 0 || tlb_entries > MAX_TLB_ENTRIES || tlb_ways < 1 || tlb_entries % tlb_ways != 0 ||
+        (sets & (sets - 1)) != 0) {
+        fprintf(stderr, "The TLB needs 0 to %d entries, a power of two number of sets of %d ways\n",
+                MAX_TLB_ENTRIES, tlb_ways);
+        return -1;
+    }
+    if (tlb_entries > 0) {
+        tlb_sets = tlb_entries / tlb_ways;
+        tlb = calloc(tlb_entries, sizeof(TlbEntry));
+        if (tlb == NULL) {
+            perror("Unable to allocate the TLB");
+            exit(1);
+        }
     }
-    args[i] = NULL;
+    return 0;
 }
 
-// Allocate Frame for a Process
-int allocate_frame(int process_id, int page_number) {
-    if (next_free_frame < FRAME_COUNT) {
-        int frame_number = next_free_frame++;
-        physical_memory[frame_number].process_id = process_id;
-        physical_memory[frame_number].page_number = page_number;
-        physical_memory[frame_number].valid = true;
-        return frame_number;
+// Select a TLB Replacement Policy by Name. Returns -1 if there is none.
+int select_tlb_policy(const char *name) {
+    for (int i = 0; i < (int)(sizeof(tlb_policy_names) / sizeof(tlb_policy_names[0])); i++) {
+        if (strcmp(tlb_policy_names[i], name) == 0) {
+            tlb_policy = i;
+            return 0;
+        }
     }
-    // Implement a page replacement algorithm here (e.g., FIFO, LRU)
-    return -1; // No free frames available
+    return -1;
 }
 
-// Handle Page Fault by Allocating Frame and Loading Page
-void handle_page_fault(int process_id, int page_number) {
-    int frame_number = allocate_frame(process_id, page_number);
+// Find the Cached Translation of a Page. Returns NULL on a TLB miss.
+TlbEntry *tlb_lookup(int asid, long page_number) {
+    TlbEntry *set = &tlb[(page_number & (tlb_sets - 1)) * tlb_ways];
+    for (int i = 0; i < tlb_ways; i++) {
+        if (set[i].valid && set[i].page_number == page_number && set[i].asid == asid) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
+
+// Cache a Translation, Replacing an Entry of its Set if the Set is Full
+void tlb_fill(int asid, long page_number, int frame_number) {
+    TlbEntry *set = &tlb[(page_number & (tlb_sets - 1)) * tlb_ways];
+    TlbEntry *entry = NULL;
+    for (int i = 0; i < tlb_ways && entry == NULL; i++) {
+        if (!set[i].valid) {
+            entry = &set[i];
+        }
+    }
+    if (entry == NULL && tlb_policy == TLB_RANDOM) {
+        entry = &set[rand() % tlb_ways];
+    } else if (entry == NULL) {
+        entry = &set[0];
+        for (int i = 1; i < tlb_ways; i++) {
+            if (set[i].stamp < entry->stamp) {
+                entry = &set[i];
+            }
+        }
+    }
+    entry->valid = true;
+    entry->asid = asid;
+    entry->page_number = page_number;
+    entry->frame_number = frame_number;
+    entry->stamp = ++tlb_clock;
+}
+
+// Drop the Cached Translation of a Page that is Evicted or Freed
+void tlb_invalidate(int asid, long page_number) {
+    TlbEntry *entry = tlb != NULL ? tlb_lookup(asid, page_number) : NULL;
+    if (entry != NULL) {
+        entry->valid = false;
+    }
+}
+
+void tlb_flush() {
+    for (int i = 0; i < tlb_entries; i++) {
+        tlb[i].valid = false;
+    }
+    stats.tlb_flushes++;
+}
+
+// Mark the First num_frames Frames Free
+void init_free_frames() {
+    memset(free_frames, 0, sizeof(free_frames));
+    for (int i = 0; i < num_frames; i++) {
+        free_frames[i / 64] |= 1ULL << (i % 64);
+    }
+}
+
+// Take the Lowest Numbered Free Frame. Returns -1 if there is none.
+int take_free_frame() {
+    for (int i = 0; i < FRAME_WORDS; i++) {
+        if (free_frames[i] != 0) {
+            int bit = __builtin_ctzll(free_frames[i]);
+            free_frames[i] &= free_frames[i] - 1;
+            return i * 64 + bit;
+        }
+    }
+    return -1;
+}
+
+// Return a Frame to the Free Bitmap
+void release_frame(int frame_number) {
+    physical_memory[frame_number].valid = false;
+    physical_memory[frame_number].dirty = false;
+    free_frames[frame_number / 64] |= 1ULL << (frame_number % 64);
+}
+
+// Evict the Page in a Frame, Writing it Back First if it is Dirty
+void evict_frame(int frame_number) {
+    Frame *frame = &physical_memory[frame_number];
+    unmap_page(find_process(frame->process_id, false), frame->page_number);
+    tlb_invalidate(frame->process_id, frame->page_number);
+    stats.evictions++;
+    if (frame->dirty) {
+        stats.writebacks++; // The page would be written to swap here
+    }
+    if (verbose) {
+        printf("Evicted page %ld of process %d from frame %d%s\n", frame->page_number, frame->process_id,
+               frame_number, frame->dirty ? " (written back)" : "");
+    }
+    frame->valid = false;
+    frame->dirty = false;
+}
+
+// Allocate Frame for a Process, Evicting a Page if Memory is Full
+int allocate_frame(int process_id, long page_number) {
+    uint64_t key = page_key(process_id, page_number);
+    int frame_number = take_free_frame();
     if (frame_number == -1) {
-        printf("No free frames available. Page replacement needed.\n");
+        double start = now_seconds();
+        frame_number = policy->victim(key);
+        stats.victim_seconds += now_seconds() - start;
+        evict_frame(frame_number);
+    }
+    physical_memory[frame_number].process_id = process_id;
+    physical_memory[frame_number].page_number = page_number;
+    physical_memory[frame_number].valid = true;
+    physical_memory[frame_number].dirty = false;
+    policy->loaded(frame_number, key);
+    return frame_number;
+}
+
+// Handle Page Fault by Allocating Frame and Loading Page. Returns the frame.
+int handle_page_fault(ProcessControlBlock *process, long page_number) {
+    int frame_number = allocate_frame(process->pid, page_number);
+    stats.faults++;
+    map_page(process, page_number, frame_number);
+    if (verbose) {
+        printf("Page %ld allocated to frame %d for process %d\n", page_number, frame_number, process->pid);
+    }
+    return frame_number;
+}
+
+// Translate a Virtual Address of a Process to a Physical Address. The
+// TLB is searched first, then the page table, and the page is faulted in
+// only if it is not resident. Writes mark the frame dirty so it is
+// written back when evicted. Returns -1 for an address outside the
+// process's address space.
+int64_t translate(int process_id, uint64_t address, bool write) {
+    long page_number = address / PAGE_SIZE;
+    ProcessControlBlock *process = address < VIRTUAL_MEMORY_SIZE ? find_process(process_id, true) : NULL;
+    if (process == NULL) {
+        stats.invalid++;
+        if (verbose) {
+            printf("Invalid access for process %d address 0x%llx\n", process_id, (unsigned long long)address);
+        }
+        return -1;
+    }
+    stats.accesses++;
+    if (process_id != last_process) {
+        if (last_process != -1) {
+            stats.context_switches++;
+            if (tlb_flush_on_switch && tlb != NULL) {
+                tlb_flush();
+            }
+        }
+        last_process = process_id;
+    }
+
+    TlbEntry *cached = tlb != NULL ? tlb_lookup(process_id, page_number) : NULL;
+    int frame_number;
+    bool resident = true;
+    if (cached != NULL) {
+        stats.tlb_hits++;
+        if (tlb_policy == TLB_LRU) {
+            cached->stamp = ++tlb_clock;
+        }
+        frame_number = cached->frame_number;
+    } else {
+        PageTableEntry *entry = find_page_entry(process, page_number);
+        stats.walks++;
+        if (entry != NULL && entry->valid) {
+            frame_number = entry->frame_number;
+        } else {
+            resident = false;
+            frame_number = handle_page_fault(process, page_number);
+        }
+        if (tlb != NULL) {
+            tlb_fill(process_id, page_number, frame_number);
+        }
+    }
+    if (resident) {
+        stats.hits++;
+        policy->hit(frame_number);
+        if (verbose) {
+            printf("Page %ld found in frame %d for process %d%s\n", page_number, frame_number, process_id,
+                   cached != NULL ? " (TLB hit)" : "");
+        }
+    }
+    if (write) {
+        physical_memory[frame_number].dirty = true;
+    }
+    return (int64_t)frame_number * PAGE_SIZE + address % PAGE_SIZE;
+}
+
+// Access a Page of a Process
+void access_memory(int process_id, long page_number, bool write) {
+    if (page_number < 0 || (uint64_t)page_number >= VIRTUAL_MEMORY_SIZE / PAGE_SIZE) {
+        stats.invalid++;
+        printf("Invalid access for process %d page %ld\n", process_id, page_number);
         return;
     }
-    processes[process_id].page_table.entries[page_number].frame_number = frame_number;
-    processes[process_id].page_table.entries[page_number].valid = true;
-    printf("Page %d allocated to frame %d for process %d\n", page_number, frame_number, process_id);
+    translate(process_id, (uint64_t)page_number * PAGE_SIZE, write);
 }
 
 // Free a Specific Frame and Update Page Table
-void free_memory(int process_id, int page_number) {
-    int frame_number = processes[process_id].page_table.entries[page_number].frame_number;
-    if (frame_number != -1 && processes[process_id].page_table.entries[page_number].valid) {
-        physical_memory[frame_number].valid = false;
-        processes[process_id].page_table.entries[page_number].valid = false;
-        printf("Freed frame %d for process %d page %d\n", frame_number, process_id, page_number);
-    } else {
-        printf("Invalid free request for process %d page %d\n", process_id, page_number);
+void free_memory(int process_id, long page_number) {
+    ProcessControlBlock *process = find_process(process_id, false);
+    bool in_range = page_number >= 0 && (uint64_t)page_number < VIRTUAL_MEMORY_SIZE / PAGE_SIZE;
+    PageTableEntry *entry = process != NULL && in_range ? find_page_entry(process, page_number) : NULL;
+    Frame *frame = entry != NULL ? &physical_memory[entry->frame_number] : NULL;
+    if (entry != NULL && entry->valid && frame->valid && frame->process_id == process_id &&
+        frame->page_number == page_number) {
+        int frame_number = entry->frame_number;
+        policy->freed(frame_number);
+        release_frame(frame_number);
+        tlb_invalidate(process_id, page_number);
+        unmap_page(process, page_number);
+        if (verbose) {
+            printf("Freed frame %d for process %d page %ld\n", frame_number, process_id, page_number);
+        }
+    } else if (verbose) {
+        printf("Invalid free request for process %d page %ld\n", process_id, page_number);
+    }
+}
+
+// Print the Mapped Pages under a Page Table Node, Stopping once all of
+// the Node's Used Entries have been Seen
+static void show_page_table(PageTableNode *node, int level, long base) {
+    int seen = 0;
+    for (int i = 0; i < LEVEL_SIZE && seen < node->used; i++) {
+        long page_number = base << LEVEL_BITS | i;
+        if (level < PAGE_TABLE_LEVELS - 1 && node->children[i] != NULL) {
+            show_page_table(node->children[i], level + 1, page_number);
+            seen++;
+        } else if (level == PAGE_TABLE_LEVELS - 1 && node->entries[i].valid) {
+            printf("  Page %ld -> Frame %d\n", page_number, node->entries[i].frame_number);
+            seen++;
+        }
     }
 }
 
@@ -123,24 +1180,431 @@ void show_memory() {
     printf("Physical Memory State:\n");
     for (int i = 0; i < FRAME_COUNT; i++) {
         if (physical_memory[i].valid) {
-            printf("Frame %d: Process %d Page %d\n", i, physical_memory[i].process_id, physical_memory[i].page_number);
+            printf("Frame %d: Process %d Page %ld\n", i, physical_memory[i].process_id, physical_memory[i].page_number);
         }
     }
     printf("Page Tables:\n");
-    for (int i = 0; i < FRAME_COUNT; i++) {
-        if (processes[i].pid != 0) {
-            printf("Process %d Page Table:\n", processes[i].pid);
-            for (int j = 0; j < FRAME_COUNT; j++) {
-                if (processes[i].page_table.entries[j].valid) {
-                    printf("  Page %d -> Frame %d\n", j, processes[i].page_table.entries[j].frame_number);
-                }
+    for (int i = 0; i < process_capacity; i++) {
+        if (processes[i] != NULL && processes[i]->page_directory != NULL) {
+            printf("Process %d Page Table:\n", processes[i]->pid);
+            show_page_table(processes[i]->page_directory, 0, 0);
+        }
+    }
+}
+
+// Display the Paging Statistics of the Replacement Policy
+void show_stats() {
+    printf("Policy %s with %d frames\n", policy->name, num_frames);
+    printf("Accesses: %ld, hits: %ld, faults: %ld, hit rate: %.2f%%\n", stats.accesses, stats.hits,
+           stats.faults, stats.accesses > 0 ? 100.0 * stats.hits / stats.accesses : 0.0);
+    printf("Evictions: %ld, dirty writebacks: %ld, average time to choose a victim: %.0f ns\n",
+           stats.evictions, stats.writebacks,
+           stats.evictions > 0 ? stats.victim_seconds * 1e9 / stats.evictions : 0.0);
+    if (tlb != NULL) {
+        printf("TLB: %d entries, %d-way, %s%s, hits: %ld, hit rate: %.2f%%, context switches: %ld, flushes: %ld\n",
+               tlb_entries, tlb_ways, tlb_policy_names[tlb_policy], tlb_flush_on_switch ? ", flushed on switch" : "",
+               stats.tlb_hits, stats.accesses > 0 ? 100.0 * stats.tlb_hits / stats.accesses : 0.0,
+               stats.context_switches, stats.tlb_flushes);
+    } else {
+        printf("TLB: off\n");
+    }
+    printf("Page tables: %ld KB now, %ld KB at most, for %d processes (process table %ld KB)\n",
+           page_table_bytes / 1024, peak_page_table_bytes / 1024, num_processes,
+           (long)(process_capacity * sizeof(*processes) + num_processes * sizeof(**processes)) / 1024);
+    printf("Page table walks: %ld, average translation cost: %.1f cycles\n", stats.walks,
+           stats.accesses > 0 ? (double)(stats.accesses * (tlb != NULL ? TLB_LOOKUP_COST : 0) +
+                                         stats.walks * PAGE_TABLE_LEVELS * PAGE_WALK_COST) / stats.accesses
+                              : 0.0);
+}
+
+// Time a Million Random Accesses and Frees Spread over 16 Processes,
+// with Four Times as Many Pages as Frames so Evictions Happen Too
+int run_frame_benchmark() {
+    enum { OPERATIONS = 1000000, PROCESSES = 16 };
+    static int ops[OPERATIONS][3]; // Process, page and kind: 0 read, 1 write, 2 free
+    int pages = 4 * num_frames / PROCESSES > 0 ? 4 * num_frames / PROCESSES : 1;
+    unsigned seed = 12345;
+    for (int i = 0; i < OPERATIONS; i++) {
+        seed = seed * 1103515245u + 12345u;
+        ops[i][0] = (seed >> 8) % PROCESSES;
+        ops[i][1] = (seed >> 12) % pages;
+        ops[i][2] = (seed >> 24) % 10 < 3 ? 2 : (seed >> 24) % 10 < 6; // 30% frees, 30% writes
+    }
+    verbose = false;
+    double start = now_seconds();
+    for (int i = 0; i < OPERATIONS; i++) {
+        if (ops[i][2] == 2) {
+            free_memory(ops[i][0], ops[i][1]);
+        } else {
+            access_memory(ops[i][0], ops[i][1], ops[i][2] == 1);
+        }
+    }
+    double elapsed = now_seconds() - start;
+    verbose = true;
+    printf("%d operations in %.1f ms, %.0f ns each\n", OPERATIONS, elapsed * 1e3, elapsed * 1e9 / OPERATIONS);
+    show_stats();
+    return 0;
+}
+
+// Get the Resident Set Size in KB from /proc
+static long resident_kb() {
+    char line[256];
+    long kb = -1;
+    FILE *file = fopen("/proc/self/status", "r");
+    while (file != NULL && fgets(line, sizeof(line), file)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) {
+            kb = atol(line + 6);
+        }
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+    return kb;
+}
+
+// Time show_memory after Each of Many Processes has Touched a Few Pages
+// Spread across its Address Space, and Report the Resident Set Size
+int run_table_benchmark(int process_count, int pages_per_process, long page_stride) {
+    long start_kb = resident_kb();
+    verbose = false;
+    for (int i = 0; i < pages_per_process; i++) {
+        for (int p = 0; p < process_count; p++) {
+            access_memory(p, i * page_stride, false);
+        }
+    }
+    verbose = true;
+    long touched_kb = resident_kb();
+
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO), null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    double start = now_seconds();
+    show_memory();
+    fflush(stdout);
+    double elapsed = now_seconds() - start;
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(null);
+    printf("%d processes, %d pages each %ld pages apart: RSS %ld KB at start, %ld KB after, show_memory %.3f ms\n",
+           process_count, pages_per_process, page_stride, start_kb, touched_kb, elapsed * 1e3);
+    show_stats();
+    return 0;
+}
+
+// Memory Reference Traces
+// A trace lists the addresses each process touches. Text traces have one
+// reference per line, "PID ADDRESS [r|w]", where the address is decimal or
+// 0x hex and blank lines and lines starting with # are skipped. Binary
+// traces start with TRACE_MAGIC and hold one 64-bit little endian word per
+// reference: the address in the low 48 bits, bit 48 set for a write and
+// the process id above it. Traces are mapped rather than read, so a
+// multi-gigabyte trace costs no more memory than the pages being replayed.
+#define TRACE_MAGIC "VMTRACE1"
+#define TRACE_ADDRESS_BITS 48
+#define TRACE_MAX_PID ((1 << (63 - TRACE_ADDRESS_BITS)) - 1)
+#define WORKING_SET_WINDOW 10000 // Default references per working set window
+
+typedef struct {
+    int process_id;
+    uint64_t address;
+    bool write;
+} TraceRecord;
+
+typedef struct {
+    const char *data;
+    size_t size;
+    size_t pos;
+    bool binary;
+    long line; // Line being read, for error messages
+} Trace;
+
+// Map a Trace File and Work Out its Format. Returns -1 on error.
+int open_trace(const char *filename, Trace *trace) {
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Unable to open trace");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    memset(trace, 0, sizeof(*trace));
+    trace->size = st.st_size;
+    trace->data = "";
+    if (trace->size > 0) {
+        void *data = mmap(NULL, trace->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror("Unable to map trace");
+            close(fd);
+            return -1;
+        }
+        madvise(data, trace->size, MADV_SEQUENTIAL);
+        trace->data = data;
+    }
+    close(fd);
+    if (trace->size >= strlen(TRACE_MAGIC) && memcmp(trace->data, TRACE_MAGIC, strlen(TRACE_MAGIC)) == 0) {
+        trace->binary = true;
+        trace->pos = strlen(TRACE_MAGIC);
+    }
+    return 0;
+}
+
+void close_trace(Trace *trace) {
+    if (trace->size > 0) {
+        munmap((void *)trace->data, trace->size);
+    }
+}
+
+// Read a Decimal or 0x Hex Number without Running Past the End of the Map
+static bool trace_number(Trace *trace, uint64_t *value) {
+    const char *p = trace->data + trace->pos, *end = trace->data + trace->size;
+    int base = 10, digits = 0;
+    *value = 0;
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base = 16;
+        p += 2;
+    }
+    for (; p < end; p++, digits++) {
+        int digit;
+        if (*p >= '0' && *p <= '9') {
+            digit = *p - '0';
+        } else if (base == 16 && *p >= 'a' && *p <= 'f') {
+            digit = *p - 'a' + 10;
+        } else if (base == 16 && *p >= 'A' && *p <= 'F') {
+            digit = *p - 'A' + 10;
+        } else {
+            break;
+        }
+        *value = *value * base + digit;
+    }
+    trace->pos = p - trace->data;
+    return digits > 0;
+}
+
+// Skip Spaces and Tabs on the Current Line
+static void trace_skip_blanks(Trace *trace) {
+    while (trace->pos < trace->size && (trace->data[trace->pos] == ' ' || trace->data[trace->pos] == '\t')) {
+        trace->pos++;
+    }
+}
+
+// Read the Next Reference. Returns 1, 0 at the end of the trace, or -1
+// after printing an error for a malformed line or a truncated record.
+int next_trace_record(Trace *trace, TraceRecord *record) {
+    if (trace->binary) {
+        uint64_t word;
+        if (trace->pos == trace->size) {
+            return 0;
+        }
+        if (trace->size - trace->pos < sizeof(word)) {
+            fprintf(stderr, "Trace ends in the middle of a record\n");
+            return -1;
+        }
+        memcpy(&word, trace->data + trace->pos, sizeof(word));
+        trace->pos += sizeof(word);
+        record->address = word & ((1ULL << TRACE_ADDRESS_BITS) - 1);
+        record->write = (word >> TRACE_ADDRESS_BITS) & 1;
+        record->process_id = word >> (TRACE_ADDRESS_BITS + 1);
+        return 1;
+    }
+    while (trace->pos < trace->size) {
+        uint64_t process_id, address;
+        trace->line++;
+        trace_skip_blanks(trace);
+        if (trace->pos == trace->size) {
+            break;
+        }
+        if (trace->data[trace->pos] == '\n' || trace->data[trace->pos] == '\r' || trace->data[trace->pos] == '#') {
+            const char *newline = memchr(trace->data + trace->pos, '\n', trace->size - trace->pos);
+            trace->pos = newline != NULL ? (size_t)(newline - trace->data) + 1 : trace->size;
+            continue;
+        }
+        bool ok = trace_number(trace, &process_id) && process_id <= TRACE_MAX_PID;
+        trace_skip_blanks(trace);
+        ok = ok && trace_number(trace, &address) && address < (1ULL << TRACE_ADDRESS_BITS);
+        trace_skip_blanks(trace);
+        record->write = false;
+        if (ok && trace->pos < trace->size && strchr("rRwW", trace->data[trace->pos]) != NULL) {
+            record->write = trace->data[trace->pos] == 'w' || trace->data[trace->pos] == 'W';
+            trace->pos++;
+            trace_skip_blanks(trace);
+        }
+        if (trace->pos < trace->size && trace->data[trace->pos] == '\r') {
+            trace->pos++;
+        }
+        if (!ok || (trace->pos < trace->size && trace->data[trace->pos] != '\n')) {
+            fprintf(stderr, "Bad trace line %ld, expected PID ADDRESS [r|w]\n", trace->line);
+            return -1;
+        }
+        trace->pos++;
+        record->process_id = process_id;
+        record->address = address;
+        return 1;
+    }
+    return 0;
+}
+
+// Pages Seen During a Replay, with the Working Set Window that Last Used
+// Each, in an Open Addressing Table that Doubles when Half Full
+typedef struct {
+    uint64_t key;
+    long window; // Window number plus one, 0 for an empty slot
+} SeenPage;
+
+SeenPage *seen_pages = NULL;
+size_t seen_capacity = 0;
+size_t num_seen = 0;
+
+static size_t seen_slot(uint64_t key) {
+    size_t slot = (key * 0x9e3779b97f4a7c15ULL) >> 17 & (seen_capacity - 1);
+    while (seen_pages[slot].window != 0 && seen_pages[slot].key != key) {
+        slot = (slot + 1) & (seen_capacity - 1);
+    }
+    return slot;
+}
+
+// Find the Window a Page was Last Seen in, Adding the Page if it is New
+long *seen_window(uint64_t key) {
+    if (2 * (num_seen + 1) > seen_capacity) {
+        SeenPage *old = seen_pages;
+        size_t old_capacity = seen_capacity;
+        seen_capacity = seen_capacity > 0 ? 2 * seen_capacity : 4096;
+        seen_pages = calloc(seen_capacity, sizeof(SeenPage));
+        if (seen_pages == NULL) {
+            perror("Unable to grow the working set table");
+            exit(1);
+        }
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].window != 0) {
+                seen_pages[seen_slot(old[i].key)] = old[i];
             }
         }
+        free(old);
+    }
+    size_t slot = seen_slot(key);
+    if (seen_pages[slot].window == 0) {
+        seen_pages[slot].key = key;
+        num_seen++;
     }
+    return &seen_pages[slot].window;
 }
 
-// Execute Command in a Child Process
-void execute_command(char **args) {
+// Replay a Trace through the Page Tables without Printing Each Reference,
+// then Print the Fault Rate, Working Set Size and Timing
+int replay_trace(const char *filename, long window) {
+    Trace trace;
+    TraceRecord record;
+    long references = 0, window_pages = 0, windows = 0, total_window_pages = 0, max_window_pages = 0;
+    int result;
+    if (open_trace(filename, &trace) != 0) {
+        return 1;
+    }
+    verbose = false;
+    double start = now_seconds();
+    while ((result = next_trace_record(&trace, &record)) == 1) {
+        references++;
+        if (translate(record.process_id, record.address, record.write) != -1) {
+            long *last = seen_window(page_key(record.process_id, record.address / PAGE_SIZE));
+            if (*last != windows + 1) {
+                *last = windows + 1;
+                window_pages++;
+            }
+        }
+        if (references % window == 0) {
+            total_window_pages += window_pages;
+            max_window_pages = window_pages > max_window_pages ? window_pages : max_window_pages;
+            windows++;
+            window_pages = 0;
+        }
+    }
+    double elapsed = now_seconds() - start;
+    verbose = true;
+    close_trace(&trace);
+    if (result < 0) {
+        return 1;
+    }
+    if (windows == 0) { // Count a trace shorter than one window as a single window
+        total_window_pages = max_window_pages = window_pages;
+        windows = 1;
+    }
+
+    printf("Replayed %ld references from a %s trace in %.1f ms, %.1f ns each (%.2f million per second)\n",
+           references, trace.binary ? "binary" : "text", elapsed * 1e3,
+           references > 0 ? elapsed * 1e9 / references : 0.0, elapsed > 0 ? references / elapsed / 1e6 : 0.0);
+    show_stats();
+    printf("Fault rate: %.2f%%, %ld references outside the address space skipped\n",
+           stats.accesses > 0 ? 100.0 * stats.faults / stats.accesses : 0.0, stats.invalid);
+    printf("Working set: %.1f pages on average, %ld at most, per window of %ld references; %ld pages touched\n",
+           (double)total_window_pages / windows, max_window_pages, window, (long)num_seen);
+    return 0;
+}
+
+// Convert a Text Trace to the Binary Format
+int convert_trace(const char *input, const char *output) {
+    Trace trace;
+    TraceRecord record;
+    long references = 0;
+    int result;
+    if (open_trace(input, &trace) != 0) {
+        return 1;
+    }
+    FILE *file = fopen(output, "wb");
+    if (file == NULL) {
+        perror("Unable to create binary trace");
+        close_trace(&trace);
+        return 1;
+    }
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), file);
+    while ((result = next_trace_record(&trace, &record)) == 1) {
+        uint64_t word = record.address | (uint64_t)record.write << TRACE_ADDRESS_BITS |
+                        (uint64_t)record.process_id << (TRACE_ADDRESS_BITS + 1);
+        fwrite(&word, sizeof(word), 1, file);
+        references++;
+    }
+    close_trace(&trace);
+    if (fclose(file) != 0 || result < 0) {
+        if (result == 0) {
+            perror("Unable to write binary trace");
+        }
+        unlink(output);
+        return 1;
+    }
+    printf("Wrote %ld references to %s\n", references, output);
+    return 0;
+}
+
+// Memory builtins
+static void builtin_access_memory(char **args) {
+    if (args[2] != NULL && strcmp(args[2], "r") != 0 && strcmp(args[2], "w") != 0) {
+        printf("Usage: access_memory PROCESS PAGE [r|w]\n");
+        return;
+    }
+    access_memory(atoi(args[0]), atol(args[1]), args[2] != NULL && strcmp(args[2], "w") == 0);
+}
+
+static void builtin_free_memory(char **args) {
+    free_memory(atoi(args[0]), atol(args[1]));
+}
+
+static void builtin_show_memory(char **args) {
+    show_memory();
+}
+
+static void builtin_show_stats(char **args) {
+    show_stats();
+}
+
+const Builtin memory_builtins[] = {
+    {"access_memory", NULL, "nns", 2, "access_memory PROCESS PAGE [r|w]", builtin_access_memory},
+    {"free_memory", NULL, "nn", 2, "free_memory PROCESS PAGE", builtin_free_memory},
+    {"show_memory", NULL, "", 0, "show_memory", builtin_show_memory},
+    {"show_stats", NULL, "", 0, "show_stats", builtin_show_stats},
+};
+
+// Execute Command in a Child Process and return its exit status
+int execute_command(char **args) {
+    int status = 0;
     child_pid = fork();
     if (child_pid < 0) {
         perror("Fork failed");
@@ -148,38 +1612,64 @@ void execute_command(char **args) {
     } else if (child_pid == 0) {
         if (execvp(args[0], args) == -1) {
             perror("Exec failed");
-            exit(1);
+            exit(127);
         }
     } else {
-        int status;
         waitpid(child_pid, &status, 0);
         child_pid = -1;
     }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
 }
 
-// Execute Multiple Commands Separated by ";"
+// Execute Multiple Commands Separated by ";", "&&" or "||"
 void execute_commands(char *line) {
-    char *commands[MAX_ARGS];
-    split_commands(line, commands);
-    for (int i = 0; commands[i] != NULL; i++) {
-        char *args[MAX_ARGS];
-        parse_command(commands[i], args);
-        if (strcmp(args[0], "access_memory") == 0) {
-            int process_id = atoi(args[1]);
-            int page_number = atoi(args[2]);
-            handle_page_fault(process_id, page_number);
-        } else if (strcmp(args[0], "free_memory") == 0) {
-            int process_id = atoi(args[1]);
-            int page_number = atoi(args[2]);
-            free_memory(process_id, page_number);
-        } else if (strcmp(args[0], "show_memory") == 0) {
-            show_memory();
+    ParsedLine parsed;
+    int status = 0;
+    if (parse_line(line, &parsed) != 0) {
+        fprintf(stderr, "%s\n", parsed.error);
+        return;
+    }
+    for (int i = 0; i < parsed.num_pipelines; i++) {
+        Pipeline *pipeline = &parsed.pipelines[i];
+        Command *command = &pipeline->stages[0];
+        const Builtin *builtin = find_builtin(command);
+        if ((pipeline->condition == RUN_IF_SUCCESS && status != 0) ||
+            (pipeline->condition == RUN_IF_FAILURE && status == 0)) {
+            continue;
+        }
+        if (pipeline->num_stages > 1 || pipeline->background || command->input || command->output) {
+            fprintf(stderr, "Pipelines, redirection and background jobs are not supported\n");
+            status = 2;
+        } else if (builtin != NULL) {
+            status = run_builtin(builtin, command);
         } else {
-            execute_command(args);
+            status = execute_command(command->args);
         }
     }
 }
 
+// Read One Line of a Batch File Without Its Newline. A line too long for
+// the buffer is reported and skipped up to its newline rather than run in
+// pieces. Returns 1 for a line, 0 for a skipped one, -1 at the end
+int read_batch_line(FILE *file, char *line, int size) {
+    if (!fgets(line, size, file)) {
+        return -1;
+    }
+    size_t length = strcspn(line, "\n");
+    if (line[length] == '\0' && length == (size_t)size - 1) {
+        int c = getc(file);
+        if (c != EOF && c != '\n') {
+            while (c != EOF && c != '\n') {
+                c = getc(file);
+            }
+            fprintf(stderr, "Line too long\n");
+            return 0;
+        }
+    }
+    line[length] = '\0';
+    return 1;
+}
+
 // Execute Commands from a Batch File
 void execute_batch_file(char *filename) {
     FILE *file = fopen(filename, "r");
@@ -189,8 +1679,11 @@ void execute_batch_file(char *filename) {
     }
 
     char line[MAX_LINE];
-    while (fgets(line, sizeof(line), file)) {
-        line[strcspn(line, "\n")] = 0;
+    int result;
+    while ((result = read_batch_line(file, line, sizeof(line))) >= 0) {
+        if (result == 0) {
+            continue;
+        }
         printf("Batch command: %s\n", line);
         execute_commands(line);
     }
@@ -201,11 +1694,86 @@ void execute_batch_file(char *filename) {
 int main(int argc, char *argv[]) {
     signal(SIGINT, exit_shell);
     signal(SIGQUIT, end_execution);
+    register_builtins(memory_builtins, sizeof(memory_builtins) / sizeof(memory_builtins[0]));
 
     using_history();
 
-    if (argc == 2) {
-        execute_batch_file(argv[1]);
+    char *batch_file = NULL;
+    bool benchmark = false;
+    int table_benchmark = 0; // Processes for --bench-tables
+    char *replay_file = NULL;
+    long window = WORKING_SET_WINDOW;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--policy") == 0 && i + 1 < argc) {
+            if (select_policy(argv[++i]) != 0) {
+                fprintf(stderr, "Unknown policy %s, use fifo, clock, aging or arc\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            num_frames = atoi(argv[++i]);
+            if (num_frames < 1 || num_frames > FRAME_COUNT) {
+                fprintf(stderr, "Frames must be between 1 and %d\n", FRAME_COUNT);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_file = argv[++i];
+        } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+            window = atol(argv[++i]);
+            if (window < 1) {
+                fprintf(stderr, "The working set window must be at least 1 reference\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--convert") == 0 && i + 2 < argc) {
+            return convert_trace(argv[i + 1], argv[i + 2]);
+        } else if (strcmp(argv[i], "--tlb-entries") == 0 && i + 1 < argc) {
+            tlb_entries = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tlb-ways") == 0 && i + 1 < argc) {
+            tlb_ways = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tlb-policy") == 0 && i + 1 < argc) {
+            if (select_tlb_policy(argv[++i]) != 0) {
+                fprintf(stderr, "Unknown TLB policy %s, use lru, fifo or random\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--tlb-flush") == 0) {
+            tlb_flush_on_switch = true;
+        } else if (strcmp(argv[i], "--bench-tables") == 0 && i + 1 < argc) {
+            table_benchmark = atoi(argv[++i]);
+            if (table_benchmark < 1 || table_benchmark > MAX_PROCESSES) {
+                fprintf(stderr, "The table benchmark needs 1 to %d processes\n", MAX_PROCESSES);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--bench-frames") == 0) {
+            benchmark = true;
+        } else if (batch_file == NULL && argv[i][0] != '-') {
+            batch_file = argv[i];
+        } else {
+            fprintf(stderr,
+                    "Usage: %s [--policy fifo|clock|aging|arc] [--frames N]\n"
+                    "           [--tlb-entries N] [--tlb-ways N] [--tlb-policy lru|fifo|random] [--tlb-flush]\n"
+                    "           [--bench-frames | --bench-tables PROCESSES | --replay TRACE [--window N] | batch_file]\n"
+                    "       %s --convert TEXT_TRACE BINARY_TRACE\n",
+                    argv[0], argv[0]);
+            return 1;
+        }
+    }
+    policy->init();
+    init_free_frames();
+    if (init_tlb() != 0) {
+        return 1;
+    }
+
+    if (benchmark) {
+        return run_frame_benchmark();
+    }
+    if (table_benchmark > 0) {
+        return run_table_benchmark(table_benchmark, 4, 1L << 18); // Pages 1 GB apart
+    }
+    if (replay_file != NULL) {
+        return replay_trace(replay_file, window);
+    }
+
+    if (batch_file != NULL) {
+        execute_batch_file(batch_file);
         return 0;
     }
 
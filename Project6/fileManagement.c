@@ -205,6 +205,373 @@ void modify_process_priority(int process_id, int new_priority) {
     pthread_mutex_unlock(&queue_lock);
 }
 
+// Tokenizer shared by the shells. parse_line() reads the line once and
+// writes the unquoted words into the ParsedLine, which holds every word,
+// command and pipeline of the line, so nothing is allocated per token and
+// no state is kept between calls; it is safe to call from any thread.
+// Understands '...' and "..." quoting, backslash escapes, ;, &, |, &&, ||,
+// <, > and >>. Input that does not fit is an error, never cut short.
+#define MAX_WORDS 256
+#define MAX_STAGES 64
+#define MAX_PIPELINES 64
+
+// When a pipeline runs, based on the status of the one before it
+typedef enum {
+    RUN_ALWAYS,     // First pipeline, or after ";" or "&"
+    RUN_IF_SUCCESS, // After "&&"
+    RUN_IF_FAILURE  // After "||"
+} RunCondition;
+
+// One stage of a pipeline with its redirections
+typedef struct {
+    char **args;  // NULL-terminated, points into the line's word list
+    int argc;
+    char *input;  // File for "<", or NULL
+    char *output; // File for ">" or ">>", or NULL
+    int append;   // Set for ">>"
+} Command;
+
+typedef struct {
+    Command *stages;
+    int num_stages;
+    int background; // Ended by "&"
+    RunCondition condition;
+} Pipeline;
+
+typedef struct {
+    char text[MAX_LINE + 1];  // Unquoted words, each NUL-terminated
+    char *words[MAX_WORDS];   // Argument lists of every command, each ending in NULL
+    Command commands[MAX_STAGES];
+    Pipeline pipelines[MAX_PIPELINES];
+    int num_words;
+    int num_commands;
+    int num_pipelines;
+    const char *error;        // Why parse_line() failed
+} ParsedLine;
+
+// Character classes for the tokenizer's inner loops
+enum { CHAR_WORD, CHAR_SPACE, CHAR_OPERATOR, CHAR_QUOTE };
+static const unsigned char char_class[256] = {
+    ['\0'] = CHAR_OPERATOR, [';'] = CHAR_OPERATOR, ['&'] = CHAR_OPERATOR, ['|'] = CHAR_OPERATOR,
+    ['<'] = CHAR_OPERATOR, ['>'] = CHAR_OPERATOR, [' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\n'] = CHAR_SPACE,
+    ['\''] = CHAR_QUOTE, ['"'] = CHAR_QUOTE, ['\\'] = CHAR_QUOTE,
+};
+
+// Function to start a command, and a pipeline for it if none is open
+static Command *begin_command(ParsedLine *parsed, Pipeline **pipeline, RunCondition condition) {
+    if (parsed->num_commands == MAX_STAGES || (*pipeline == NULL && parsed->num_pipelines == MAX_PIPELINES)) {
+        parsed->error = "Too many commands on one line";
+        return NULL;
+    }
+    if (*pipeline == NULL) {
+        *pipeline = &parsed->pipelines[parsed->num_pipelines++];
+        (*pipeline)->stages = &parsed->commands[parsed->num_commands];
+        (*pipeline)->num_stages = 0;
+        (*pipeline)->background = 0;
+        (*pipeline)->condition = condition;
+    }
+    Command *command = &parsed->commands[parsed->num_commands++];
+    (*pipeline)->num_stages++;
+    command->args = &parsed->words[parsed->num_words];
+    command->argc = 0;
+    command->input = command->output = NULL;
+    command->append = 0;
+    return command;
+}
+
+// Function to split a line into pipelines, commands and words.
+// Returns 0 on success, or -1 with parsed->error set.
+int parse_line(const char *line, ParsedLine *parsed) {
+    const char *read = line;
+    char *write = parsed->text;
+    Pipeline *pipeline = NULL; // Pipeline being filled
+    Command *command = NULL;   // Command being filled
+    char **target = NULL;      // Redirection waiting for its file name
+    RunCondition condition = RUN_ALWAYS;
+    int need_command = 0;      // Set after "|", "&&" and "||"
+
+    parsed->num_words = parsed->num_commands = parsed->num_pipelines = 0;
+    parsed->error = NULL;
+    if (strlen(line) >= MAX_LINE) {
+        parsed->error = "Line too long";
+        return -1;
+    }
+
+    for (;;) {
+        while (char_class[(unsigned char)*read] == CHAR_SPACE) {
+            read++;
+        }
+        char c = *read;
+        if (c == '\0' || c == ';' || c == '&' || c == '|') {
+            int two = c != '\0' && c != ';' && read[1] == c; // "&&" or "||"
+            if (target != NULL) {
+                parsed->error = "Missing file name for redirection";
+                return -1;
+            }
+            if (command != NULL) {
+                if (command->argc == 0) {
+                    parsed->error = "Syntax error: missing command";
+                    return -1;
+                }
+                parsed->words[parsed->num_words++] = NULL; // Room was kept when the words were added
+                command = NULL;
+            } else if (need_command || c == '&' || c == '|') {
+                // Only ";" may follow nothing; "|", "&", "&&" and "||" need a command before them
+                parsed->error = "Syntax error: missing command";
+                return -1;
+            }
+            if (c == '\0') {
+                break;
+            }
+            read += two ? 2 : 1;
+            need_command = c == '|' || two;
+            if (c == '|' && !two) {
+                continue; // Next stage of the same pipeline
+            }
+            if (pipeline != NULL) {
+                pipeline->background = c == '&' && !two;
+            }
+            pipeline = NULL;
+            condition = !two ? RUN_ALWAYS : c == '&' ? RUN_IF_SUCCESS : RUN_IF_FAILURE;
+            continue;
+        }
+        if (command == NULL && (command = begin_command(parsed, &pipeline, condition)) == NULL) {
+            return -1;
+        }
+        if (c == '<' || c == '>') {
+            if (target != NULL) {
+                parsed->error = "Missing file name for redirection";
+                return -1;
+            }
+            if (c == '<') {
+                target = &command->input;
+            } else {
+                target = &command->output;
+                command->append = read[1] == '>';
+                read += command->append;
+            }
+            read++;
+            continue;
+        }
+
+        // A word: runs until unquoted whitespace or an operator
+        char *word = write;
+        for (;;) {
+            unsigned char kind = char_class[(unsigned char)*read];
+            if (kind == CHAR_WORD) {
+                *write++ = *read++;
+                continue;
+            }
+            if (kind != CHAR_QUOTE) {
+                break;
+            }
+            if (*read == '\'') {
+                const char *end = strchr(read + 1, '\'');
+                if (end == NULL) {
+                    parsed->error = "Unterminated quote";
+                    return -1;
+                }
+                memcpy(write, read + 1, end - read - 1);
+                write += end - read - 1;
+                read = end + 1;
+            } else if (*read == '"') {
+                for (read++; *read != '"'; read++) {
+                    if (*read == '\0') {
+                        parsed->error = "Unterminated quote";
+                        return -1;
+                    }
+                    if (*read == '\\' && read[1] != '\0' && strchr("\"\\$`", read[1])) {
+                        read++;
+                    }
+                    *write++ = *read;
+                }
+                read++;
+            } else if (read[1] != '\0') {
+                *write++ = read[1]; // Backslash escape
+                read += 2;
+            } else {
+                *write++ = *read++; // A backslash at the very end stays as it is
+            }
+        }
+        *write++ = '\0';
+        if (target != NULL) {
+            *target = word;
+            target = NULL;
+            continue;
+        }
+        if (parsed->num_words >= MAX_WORDS - 1) {
+            parsed->error = "Too many words on one line";
+            return -1;
+        }
+        parsed->words[parsed->num_words++] = word;
+        command->argc++;
+        need_command = 0;
+    }
+    return 0;
+}
+
+// Builtin commands. Each part of the program registers its own table of
+// builtins with register_builtins(), so adding one never means editing the
+// command handler. Names are placed with a perfect hash: registration
+// searches for a seed that gives every name a slot of its own, so finding
+// a builtin costs one hash and one strcmp however many there are. Entries
+// describe their arguments, which are checked before the builtin runs.
+#define MAX_BUILTINS 64
+#define BUILTIN_SLOTS 256 // Perfect hash table size, a power of two
+#define MAX_VARIANTS 4    // Entries that can share a name, told apart by their flag
+
+typedef void (*BuiltinFunction)(char **args);
+
+typedef struct {
+    const char *name;
+    const char *flag;  // Option that selects this variant, such as "-d", or NULL
+    const char *types; // One letter per argument: 's' for a string, 'n' for a number
+    int min_args;      // Arguments that can not be left out; strlen(types) is the most allowed
+    const char *usage;
+    BuiltinFunction run;
+} Builtin;
+
+// Every variant of one builtin name
+typedef struct {
+    const char *name;
+    const Builtin *variants[MAX_VARIANTS];
+    int num_variants;
+} BuiltinSlot;
+
+const Builtin *builtins[MAX_BUILTINS];
+int num_builtins = 0;
+BuiltinSlot builtin_slots[BUILTIN_SLOTS];
+unsigned builtin_seed = 0;
+
+// Function to hash a builtin name (seeded FNV-1a) to its slot
+static unsigned builtin_hash(unsigned seed, const char *name) {
+    unsigned h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    h ^= h >> 16;
+    return h & (BUILTIN_SLOTS - 1);
+}
+
+// Function to find a seed that gives every registered name its own slot
+// and fill the slots with it. Returns -1 if there is none.
+static int build_builtin_slots() {
+    for (unsigned seed = 1; seed < 100000; seed++) {
+        int ok = 1;
+        memset(builtin_slots, 0, sizeof(builtin_slots));
+        for (int i = 0; i < num_builtins; i++) {
+            BuiltinSlot *slot = &builtin_slots[builtin_hash(seed, builtins[i]->name)];
+            if (slot->name == NULL) {
+                slot->name = builtins[i]->name;
+            } else if (strcmp(slot->name, builtins[i]->name) != 0) {
+                ok = 0; // Two names collide, try the next seed
+                break;
+            }
+            slot->variants[slot->num_variants++] = builtins[i];
+        }
+        if (ok) {
+            builtin_seed = seed;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Function to add a table of builtins and rebuild the perfect hash
+void register_builtins(const Builtin *table, int count) {
+    for (int i = 0; i < count; i++) {
+        int variants = 0;
+        for (int j = 0; j < num_builtins; j++) {
+            variants += strcmp(builtins[j]->name, table[i].name) == 0;
+        }
+        if (num_builtins == MAX_BUILTINS || variants == MAX_VARIANTS) {
+            fprintf(stderr, "Too many builtins, %s not added\n", table[i].name);
+            continue;
+        }
+        builtins[num_builtins++] = &table[i];
+    }
+    if (build_builtin_slots() != 0) {
+        fprintf(stderr, "Unable to build the builtin table\n");
+        exit(1);
+    }
+}
+
+// Function to find the builtin a command names, picking the variant whose
+// flag is its first argument. Returns NULL if it is not a builtin.
+const Builtin *find_builtin(Command *command) {
+    BuiltinSlot *slot = &builtin_slots[builtin_hash(builtin_seed, command->args[0])];
+    const Builtin *plain = NULL;
+    if (slot->name == NULL || strcmp(slot->name, command->args[0]) != 0) {
+        return NULL;
+    }
+    for (int i = 0; i < slot->num_variants; i++) {
+        const Builtin *builtin = slot->variants[i];
+        if (builtin->flag == NULL) {
+            plain = builtin;
+        } else if (command->argc > 1 && strcmp(command->args[1], builtin->flag) == 0) {
+            return builtin;
+        }
+    }
+    return plain != NULL ? plain : slot->variants[0];
+}
+
+// Function to check a command's arguments against its builtin and run it.
+// Returns 0, or 2 after printing the usage when the arguments do not fit.
+int run_builtin(const Builtin *builtin, Command *command) {
+    int first = builtin->flag != NULL ? 2 : 1;
+    int count = command->argc - first;
+    int ok = count >= builtin->min_args && count <= (int)strlen(builtin->types) &&
+             (builtin->flag == NULL || strcmp(command->args[1], builtin->flag) == 0);
+    for (int i = 0; ok && i < count; i++) {
+        char *end;
+        if (builtin->types[i] == 'n') {
+            strtol(command->args[first + i], &end, 10);
+            ok = end != command->args[first + i] && *end == '\0';
+        }
+    }
+    if (!ok) {
+        printf("Usage: %s\n", builtin->usage);
+        return 2;
+    }
+    builtin->run(command->args + first);
+    return 0;
+}
+
+// Scheduler builtins
+static void builtin_procs(char **args) {
+    list_processes(false);
+}
+
+static void builtin_procs_detailed(char **args) {
+    list_processes(true);
+}
+
+static void builtin_info(char **args) {
+    show_process_info(atoi(args[0]));
+}
+
+static void builtin_priority(char **args) {
+    modify_process_priority(atoi(args[0]), atoi(args[1]));
+}
+
+const Builtin scheduler_builtins[] = {
+    {"procs", NULL, "", 0, "procs [-a]", builtin_procs},
+    {"procs", "-a", "", 0, "procs -a", builtin_procs_detailed},
+    {"info", NULL, "n", 1, "info ID", builtin_info},
+    {"priority", NULL, "nn", 2, "priority ID PRIORITY", builtin_priority},
+};
+
+// Function to get the command of a line that is one plain command, so it
+// can be checked against the builtins. Returns NULL when sh has to run it.
+static Command *simple_command(ParsedLine *parsed) {
+    Pipeline *pipeline = &parsed->pipelines[0];
+    if (parsed->num_pipelines != 1 || pipeline->num_stages != 1 || pipeline->background ||
+        pipeline->stages[0].input || pipeline->stages[0].output) {
+        return NULL;
+    }
+    return &pipeline->stages[0];
+}
+
 void* process_command_handler(void *arg) {
     char *line;
     while (1) {
@@ -214,94 +581,20 @@ void* process_command_handler(void *arg) {
             if (strcmp(line, "quit") == 0) {
                 free(line);
                 break;
-            } else if (strcmp(line, "procs") == 0) {
-                list_processes(false);
-            } else if (strcmp(line, "procs -a") == 0) {
-                list_processes(true);
-            } else if (strncmp(line, "info ", 5) == 0) {
-                int process_id = atoi(line + 5);
-                show_process_info(process_id);
-            } else if (strncmp(line, "priority ", 9) == 0) {
-                int process_id, new_priority;
-                sscanf(line + 9, "%d %d", &process_id, &new_priority);
-                modify_process_priority(process_id, new_priority);
-            } else if (strncmp(line, "mkdir ", 6) == 0) {
-                char path[MAX_PATH_LEN], name[MAX_NAME_LEN];
-                sscanf(line + 6, "%s %s", path, name);
-                create_directory(path, name);
-            } else if (strncmp(line, "rmdir ", 6) == 0) {
-                char path[MAX_PATH_LEN];
-                int recursive = 0;
-                if (sscanf(line + 6, "-r %s", path) == 1) {
-                    recursive = 1;
-                } else {
-                    sscanf(line + 6, "%s", path);
-                }
-                delete_directory(path, recursive);
-            } else if (strncmp(line, "touch ", 6) == 0) {
-                char path[MAX_PATH_LEN], name[MAX_NAME_LEN];
-                int size;
-                sscanf(line + 6, "%s %s %d", path, name, &size);
-                create_file(path, name, size);
-            } else if (strncmp(line, "rm ", 3) == 0) {
-                char path[MAX_PATH_LEN], name[MAX_NAME_LEN];
-                sscanf(line + 3, "%s %s", path, name);
-                delete_file(path, name);
-            } else if (strncmp(line, "ls ", 3) == 0) {
-                char path[MAX_PATH_LEN];
-                sscanf(line + 3, "%s", path);
-                list_directory(path);
-            } else if (strncmp(line, "edit ", 5) == 0) {
-                char path[MAX_PATH_LEN], name[MAX_NAME_LEN], new_content[MAX_LINE];
-                sscanf(line + 5, "%s %s %s", path, name, new_content);
-                edit_file(path, name, new_content);
-            } else if (strncmp(line, "mvfile ", 7) == 0) {
-                char src_path[MAX_PATH_LEN], file_name[MAX_NAME_LEN], dest_path[MAX_PATH_LEN];
-                sscanf(line + 7, "%s %s %s", src_path, file_name, dest_path);
-                move_file(src_path, file_name, dest_path);
-            } else if (strncmp(line, "cpfile ", 7) == 0) {
-                char path[MAX_PATH_LEN], file_name[MAX_NAME_LEN], new_name[MAX_NAME_LEN];
-                sscanf(line + 7, "%s %s %s", path, file_name, new_name);
-                duplicate_file(path, file_name, new_name);
-            } else if (strncmp(line, "cpdir ", 6) == 0) {
-                char src_path[MAX_PATH_LEN], dest_path[MAX_PATH_LEN];
-                sscanf(line + 6, "%s %s", src_path, dest_path);
-                duplicate_directory(src_path, dest_path);
-            } else if (strncmp(line, "search ", 7) == 0) {
-                char path[MAX_PATH_LEN], file_name[MAX_NAME_LEN];
-                sscanf(line + 7, "%s %s", path, file_name);
-                Directory *dir = find_directory(root, path);
-                if (dir) {
-                    search_file(dir, file_name);
-                } else {
-                    printf("Directory not found: %s\n", path);
-                }
-            } else if (strncmp(line, "tree ", 5) == 0) {
-                char path[MAX_PATH_LEN];
-                sscanf(line + 5, "%s", path);
-                Directory *dir = find_directory(root, path);
-                if (dir) {
-                    display_tree(dir, 0);
-                } else {
-                    printf("Directory not found: %s\n", path);
-                }
-            } else if (strncmp(line, "fileinfo ", 9) == 0) {
-                char path[MAX_PATH_LEN], name[MAX_NAME_LEN];
-                sscanf(line + 9, "%s %s", path, name);
-                get_file_info(path, name);
-            } else if (strncmp(line, "fileinfo -d ", 12) == 0) {
-                char path[MAX_PATH_LEN], name[MAX_NAME_LEN];
-                sscanf(line + 12, "%s %s", path, name);
-                get_file_detailed_info(path, name);
-            } else if (strncmp(line, "dirinfo ", 8) == 0) {
-                char path[MAX_PATH_LEN];
-                sscanf(line + 8, "%s", path);
-                get_directory_info(path);
-            } else if (strncmp(line, "dirinfo -d ", 11) == 0) {
-                char path[MAX_PATH_LEN];
-                sscanf(line + 11, "%s", path);
-                get_directory_detailed_info(path);
+            }
+            // The parse only picks out builtins. Everything else, including
+            // lines it can not parse such as "ls 2>&1", goes to sh unchanged.
+            ParsedLine parsed;
+            bool parsed_ok = parse_line(line, &parsed) == 0;
+            Command *command = parsed_ok ? simple_command(&parsed) : NULL;
+            const Builtin *builtin = command != NULL ? find_builtin(command) : NULL;
+            if (parsed_ok && parsed.num_pipelines == 0) {
+                // Nothing but blanks
+            } else if (builtin != NULL && (command->argc > 1 || builtin->min_args == 0)) {
+                run_builtin(builtin, command);
             } else {
+                // A builtin that needs arguments but was typed bare, like
+                // "ls", still runs the system command of that name
                 execute_command(line);
             }
             free(line);
@@ -310,6 +603,28 @@ void* process_command_handler(void *arg) {
     return NULL;
 }
 
+// Function to read one line of a batch file without its newline. A line
+// too long for the buffer is reported and skipped up to its newline rather
+// than run in pieces. Returns 1 for a line, 0 for a skipped one, -1 at the end
+int read_batch_line(FILE *file, char *line, int size) {
+    if (!fgets(line, size, file)) {
+        return -1;
+    }
+    size_t length = strcspn(line, "\n");
+    if (line[length] == '\0' && length == (size_t)size - 1) {
+        int c = getc(file);
+        if (c != EOF && c != '\n') {
+            while (c != EOF && c != '\n') {
+                c = getc(file);
+            }
+            fprintf(stderr, "Line too long\n");
+            return 0;
+        }
+    }
+    line[length] = '\0';
+    return 1;
+}
+
 void execute_batch_file(char *filename) {
     FILE *file = fopen(filename, "r");
     if (!file) {
@@ -318,8 +633,11 @@ void execute_batch_file(char *filename) {
     }
 
     char line[MAX_LINE];
-    while (fgets(line, sizeof(line), file)) {
-        line[strcspn(line, "\n")] = 0;
+    int result;
+    while ((result = read_batch_line(file, line, sizeof(line))) >= 0) {
+        if (result == 0) {
+            continue;
+        }
         printf("Batch command: %s\n", line);
         execute_command(line);
     }
@@ -348,12 +666,107 @@ void wait_for_all_processes() {
     }
 }
 
+// File system builtins
+static void builtin_mkdir(char **args) {
+    create_directory(args[0], args[1]);
+}
+
+static void builtin_rmdir(char **args) {
+    delete_directory(args[0], 0);
+}
+
+static void builtin_rmdir_recursive(char **args) {
+    delete_directory(args[0], 1);
+}
+
+static void builtin_touch(char **args) {
+    create_file(args[0], args[1], atoi(args[2]));
+}
+
+static void builtin_rm(char **args) {
+    delete_file(args[0], args[1]);
+}
+
+static void builtin_ls(char **args) {
+    list_directory(args[0]);
+}
+
+static void builtin_edit(char **args) {
+    edit_file(args[0], args[1], args[2]);
+}
+
+static void builtin_mvfile(char **args) {
+    move_file(args[0], args[1], args[2]);
+}
+
+static void builtin_cpfile(char **args) {
+    duplicate_file(args[0], args[1], args[2]);
+}
+
+static void builtin_cpdir(char **args) {
+    duplicate_directory(args[0], args[1]);
+}
+
+static void builtin_search(char **args) {
+    Directory *dir = find_directory(root, args[0]);
+    if (dir) {
+        search_file(dir, args[1]);
+    } else {
+        printf("Directory not found: %s\n", args[0]);
+    }
+}
+
+static void builtin_tree(char **args) {
+    Directory *dir = find_directory(root, args[0]);
+    if (dir) {
+        display_tree(dir, 0);
+    } else {
+        printf("Directory not found: %s\n", args[0]);
+    }
+}
+
+static void builtin_fileinfo(char **args) {
+    get_file_info(args[0], args[1]);
+}
+
+static void builtin_fileinfo_detailed(char **args) {
+    get_file_detailed_info(args[0], args[1]);
+}
+
+static void builtin_dirinfo(char **args) {
+    get_directory_info(args[0]);
+}
+
+static void builtin_dirinfo_detailed(char **args) {
+    get_directory_detailed_info(args[0]);
+}
+
+const Builtin fs_builtins[] = {
+    {"mkdir", NULL, "ss", 2, "mkdir PATH NAME", builtin_mkdir},
+    {"rmdir", NULL, "s", 1, "rmdir [-r] PATH", builtin_rmdir},
+    {"rmdir", "-r", "s", 1, "rmdir -r PATH", builtin_rmdir_recursive},
+    {"touch", NULL, "ssn", 3, "touch PATH NAME SIZE", builtin_touch},
+    {"rm", NULL, "ss", 2, "rm PATH NAME", builtin_rm},
+    {"ls", NULL, "s", 1, "ls PATH", builtin_ls},
+    {"edit", NULL, "sss", 3, "edit PATH NAME CONTENT", builtin_edit},
+    {"mvfile", NULL, "sss", 3, "mvfile SOURCE_PATH NAME DEST_PATH", builtin_mvfile},
+    {"cpfile", NULL, "sss", 3, "cpfile PATH NAME NEW_NAME", builtin_cpfile},
+    {"cpdir", NULL, "ss", 2, "cpdir SOURCE_PATH DEST_PATH", builtin_cpdir},
+    {"search", NULL, "ss", 2, "search PATH NAME", builtin_search},
+    {"tree", NULL, "s", 1, "tree PATH", builtin_tree},
+    {"fileinfo", NULL, "ss", 2, "fileinfo [-d] PATH NAME", builtin_fileinfo},
+    {"fileinfo", "-d", "ss", 2, "fileinfo -d PATH NAME", builtin_fileinfo_detailed},
+    {"dirinfo", NULL, "s", 1, "dirinfo [-d] PATH", builtin_dirinfo},
+    {"dirinfo", "-d", "s", 1, "dirinfo -d PATH", builtin_dirinfo_detailed},
+};
+
 void init_fs() {
     root = (Directory *)malloc(sizeof(Directory));
     strcpy(root->name, "/");
     strcpy(root->path, "/");
     root->files = NULL;
     root->subdirs = NULL;
+    register_builtins(fs_builtins, sizeof(fs_builtins) / sizeof(fs_builtins[0]));
 }
 
 Directory* find_directory(Directory *dir, const char *path) {
@@ -388,6 +801,10 @@ void create_directory(const char *path, const char *name) {
         printf("Directory not found: %s\n", path);
         return;
     }
+    if (strlen(name) >= MAX_NAME_LEN) {
+        printf("Error: Name is too long.\n");
+        return;
+    }
     Directory *new_dir = (Directory *)malloc(sizeof(Directory));
     strcpy(new_dir->name, name);
     snprintf(new_dir->path, MAX_PATH_LEN, "%s/%s", path, name);
@@ -403,6 +820,10 @@ void rename_directory(const char *path, const char *new_name) {
         printf("Directory not found: %s\n", path);
         return;
     }
+    if (strlen(new_name) >= MAX_NAME_LEN) {
+        printf("Error: Name is too long.\n");
+        return;
+    }
     char new_path[MAX_PATH_LEN];
     int len = snprintf(new_path, MAX_PATH_LEN, "%s/%s", dir->path, new_name);
     if (len >= MAX_PATH_LEN) {
@@ -446,6 +867,10 @@ void create_file(const char *path, const char *name, int size) {
         printf("Directory not found: %s\n", path);
         return;
     }
+    if (strlen(name) >= MAX_NAME_LEN) {
+        printf("Error: Name is too long.\n");
+        return;
+    }
     File *new_file = (File *)malloc(sizeof(File));
     strcpy(new_file->name, name);
     snprintf(new_file->path, MAX_PATH_LEN, "%s/%s", path, name);
@@ -698,6 +1123,7 @@ int main(int argc, char *argv[]) {
     pthread_t scheduler_thread, handler_thread;
     pthread_mutex_init(&queue_lock, NULL);
     pthread_cond_init(&queue_cond, NULL);
+    register_builtins(scheduler_builtins, sizeof(scheduler_builtins) / sizeof(scheduler_builtins[0]));
     init_fs();
 
     pthread_create(&scheduler_thread, NULL, scheduler, NULL);